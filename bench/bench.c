@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2025, Nikola Kolev <koue@chaosophia.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Benchmark of the storage layer: builds a database of units values a
+ * minute over days, then times reads, a copy and a truncation.  Every
+ * result is printed as a line of its name, value and unit, if any.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "data.h"
+
+int debug = 0;
+
+static const char *suffixes[] = { "", ".last", ".changes" };
+
+static double
+elapsed(const struct timespec *t0)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((t.tv_sec - t0->tv_sec) + (t.tv_nsec - t0->tv_nsec) / 1e9);
+}
+
+/* size of a database with the files next to it */
+static long long
+db_size(const char *fn)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	long long size = 0;
+	unsigned i;
+
+	for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i) {
+		snprintf(path, sizeof(path), "%s%s", fn, suffixes[i]);
+		if (stat(path, &st) == 0)
+			size += st.st_size;
+	}
+	return (size);
+}
+
+static void
+db_remove(const char *fn)
+{
+	char path[PATH_MAX];
+	unsigned i;
+
+	for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i) {
+		snprintf(path, sizeof(path), "%s%s", fn, suffixes[i]);
+		unlink(path);
+	}
+}
+
+/* a value of unit at minute i, varying slowly as most collects do */
+static double
+value(unsigned unit, unsigned i)
+{
+	return (50.0 + 40.0 * sin((i + unit * 37) / 120.0) + unit % 7);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: graffer-bench [-d days] [-f file] "
+	    "[-u units]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const unsigned ranges[] = { 3600, 86400, 7 * 86400, 0 };
+	static const unsigned widths[] = { 200, 800, 3200 };
+	struct data_conf conf;
+	struct timespec t0;
+	struct data *d;
+	const char *fn = "/tmp/graffer-bench.db";
+	char copy[PATH_MAX];
+	unsigned units = 100, days = 7, now, beg, range, i, j, k, u;
+	unsigned long long n = 0;
+	double *a, t;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "d:f:u:")) != -1) {
+		switch (ch) {
+		case 'd':
+			days = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			fn = optarg;
+			break;
+		case 'u':
+			units = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (days == 0 || units == 0 || argc != optind)
+		usage();
+	snprintf(copy, sizeof(copy), "%s.copy", fn);
+	if ((a = calloc(widths[2], sizeof(double))) == NULL)
+		err(1, "calloc");
+
+	memset(&conf, 0, sizeof(conf));
+	conf.units = units;
+	db_remove(fn);
+	if ((d = data_open(fn, 0, &conf)) == NULL)
+		return (1);
+	now = time(NULL) / 60 * 60;
+	beg = now - days * 86400;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	/* a batch a minute, as collected by -q */
+	for (i = 0; i < days * 1440; ++i) {
+		if (data_batch_begin(d))
+			return (1);
+		for (u = 1; u <= units; ++u, ++n)
+			if (data_put_value(d, 0, beg + i * 60, u,
+			    value(u, i), 0))
+				return (1);
+		if (data_batch_commit(d))
+			return (1);
+	}
+	if (data_close(d))
+		return (1);
+	t = elapsed(&t0);
+	printf("units %u\n", units);
+	printf("days %u\n", days);
+	printf("insert.values %llu\n", n);
+	printf("insert.time %.3f s\n", t);
+	printf("insert.rate %.0f values/s\n", n / t);
+	printf("size %lld bytes\n", db_size(fn));
+	printf("size.value %.2f bytes\n", (double)db_size(fn) / n);
+
+	if ((d = data_open(fn, 1, &conf)) == NULL)
+		return (1);
+	for (i = 0; i < sizeof(ranges) / sizeof(ranges[0]); ++i) {
+		range = ranges[i] ? ranges[i] : days * 86400;
+		if (range > days * 86400)
+			continue;
+		for (j = 0; j < sizeof(widths) / sizeof(widths[0]); ++j) {
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			for (k = 0, u = 1; u <= units; ++k, u += units / 16 + 1)
+				if (data_get_values(d, u, now - range, now,
+				    DATA_TYPE_AVG, widths[j], a, 0))
+					return (1);
+			printf("get_values.%us.%u %.1f us\n", range, widths[j],
+			    elapsed(&t0) * 1e6 / k);
+		}
+	}
+	if (data_close(d))
+		return (1);
+
+	if ((d = data_open(fn, 0, &conf)) == NULL)
+		return (1);
+	db_remove(copy);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (data_copy(d, copy))
+		return (1);
+	printf("copy.time %.3f s\n", elapsed(&t0));
+	printf("copy.size %lld bytes\n", db_size(copy));
+	db_remove(copy);
+	/* keep half of the detailed values, drop nothing compressed */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (data_truncate(d, (days + 1) / 2, days + 1))
+		return (1);
+	if (data_close(d))
+		return (1);
+	printf("truncate.time %.3f s\n", elapsed(&t0));
+	printf("truncate.size %lld bytes\n", db_size(fn));
+	db_remove(fn);
+	free(a);
+	return (0);
+}
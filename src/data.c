@@ -30,12 +30,22 @@
  */
 
 #include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/tree.h>
 #include <netinet/in.h>
 #include <db.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -43,60 +53,462 @@
 #include <unistd.h>
 
 #include "data.h"
+#include "sketch.h"
 
+/* key of a record, in host order, see key_pack() */
 struct key {
-	u_int16_t	 unit;
+	u_int32_t	 unit;
 	u_int16_t	 level;
 	u_int32_t	 ts;
 };
 
+/* size of a packed key, 16 bit units before format 3 */
+#define	KEY_SIZE_2	8
+#define	KEY_SIZE_3	10
+#define	KEY_SIZE(f)	((f) >= 3 ? KEY_SIZE_3 : KEY_SIZE_2)
+/* longest key, of the catalog of series names */
+#define	KEY_MAX		(4 + DATA_NAME_MAX)
+
+/* first unit assigned to a series name, above those of 16 bit */
+#define	NAMED_UNIT	(DATA_UNIT_MAX + 1U)
+
+/*
+ * Keys of the snapshot index, in format 3, the unit SNAP_UNIT followed
+ * by a bucket of level_width[0] seconds and a unit, so the values of
+ * all units at a time are next to each other.  The unit alone marks a
+ * database keeping the index.
+ */
+#define	SNAP_UNIT	((u_int32_t)0xfffffffeU)
+#define	SNAP_KEY_SIZE	12
+
+/*
+ * In format 3, the unit GEN_UNIT alone keys the generation of the values
+ * stored, counted up whenever one is stored at or before the last one of
+ * its unit, or rollups are rebuilt, so that pixels cached before are not
+ * reused.  A database without it is at generation 0.
+ */
+#define	GEN_UNIT	((u_int32_t)0xfffffffdU)
+
+/* a series name and its unit, cached from the catalog */
+struct name {
+	struct name	*next;
+	unsigned	 unit;
+	char		 name[];
+};
+
 struct val {
 	double		 min;
 	double		 avg;
 	double		 max;
+	/* rollups of format 2: number of values, their sum and squares */
+	double		 count;
+	double		 sum;
+	double		 sumsq;
+};
+
+/* level 0 values and rollups of format 1 end before the count */
+#define	VAL_SIZE_1	offsetof(struct val, count)
+
+/* format of the database, at the key of unit 0, MAX_LEVEL and MAX_TS */
+struct meta {
+	u_int32_t	 format;
+};
+
+#define	DATA_FORMAT	3
+
+/* the value stored last within a bucket of the snapshot index */
+struct snap {
+	u_int32_t	 ts;
+	u_int32_t	 pad;
+	double		 val;
 };
 
+/* last value of a differential unit, a slot of the table, 0 ts if none */
 struct last {
 	unsigned	 since;
 	unsigned	 ts;
 	double		 val;
 };
 
+/*
+ * Table of the last values, in the file database.last, with the slot of
+ * every unit at a fixed place after the header, mapped and updated in
+ * place.  Values stored before the table are in records of the unit,
+ * MAX_LEVEL and ts 0 in the database, moved to it by data_truncate(),
+ * data_copy() and data_compact().
+ */
+struct lhdr {
+	u_int32_t	 magic;
+	u_int32_t	 size;	/* of a slot */
+	u_int32_t	 pad[2];
+};
+
+#define	LAST_MAGIC	0x4c415354U	/* "LAST" */
+/* slots the file grows by */
+#define	LAST_GROW	4096
+
+struct lasttab {
+	char		*fn;
+	int		 fd;	/* -1 until the file exists */
+	int		 rdonly;
+	void		*map;
+	size_t		 size;	/* mapped */
+	struct last	*slot;
+	size_t		 nslot;
+};
+
+/* resampled values cache, key and header preceding the values */
+struct ckey {
+	u_int32_t	 unit;
+	u_int16_t	 level;
+	u_int16_t	 type;
+	u_int32_t	 siz;
+	u_int32_t	 span;
+};
+
+struct chdr {
+	double		 end;	/* window end, in pixels since the epoch */
+	unsigned	 last;	/* last record used */
+	unsigned	 gen;	/* of the values, see GEN_UNIT */
+};
+
+/* a value to be stored, also the record format of the journal */
+struct sample {
+	unsigned	 seq;
+	unsigned	 since;
+	unsigned	 ts;
+	unsigned	 unit;
+	int		 flags;	/* DATA_TDIFF, DATA_VDIFF, DATA_SKETCH */
+	double		 val;
+};
+
+/*
+ * Header of the log of changes, <database>.changes, followed by every
+ * value stored while it exists.  Change n is the (n - base)th sample,
+ * changes up to base having been dropped by data_truncate().
+ */
+struct changehdr {
+	u_int32_t	 magic;
+	u_int32_t	 size;	/* of a sample */
+	u_int64_t	 base;
+};
+
+#define	CHANGES_MAGIC	0x43484753U	/* "CHGS" */
+
+struct mem {
+	RB_ENTRY(mem)	 entry;
+	struct sample	 s;
+};
+
+RB_HEAD(memtree, mem);
+
+/* database handle, one per open database */
+struct data {
+	const char	*fn;
+	BTREEINFO	 btreeinfo;
+	DB		*db;
+	const char	*cfn;
+	DB		*cdb;
+	unsigned long	 ops;	/* database operations */
+	long		 inblock; /* block reads at open */
+	struct sample	*batch;	/* values queued by data_put_value() */
+	unsigned	 nbatch, maxbatch;
+	int		 batching;
+	int		 sync;	/* DATA_SYNC_*, or interval in seconds */
+	time_t		 synced;
+	int		 rdonly;
+	unsigned	 format;
+	int		 snap;	/* keeps the snapshot index */
+	struct data_conf conf;
+	struct data	**shard; /* opened on first use, with conf.shards */
+	char		**shardfn;
+	char		*jfn;	/* journal of values not yet in the database */
+	int		 jfd;	/* open for appending by data_journal_open() */
+	int		 flush;	/* seconds between flushes of the journal */
+	time_t		 flushed;
+	struct memtree	 mem;	/* values of the journal, in key order */
+	unsigned	 nmem;
+	unsigned	 seq;
+	struct name	**names; /* series names looked up, by hash */
+	unsigned	 nnames, maxnames;
+	struct lasttab	 lt;
+	char		*chfn;	/* log of changes, see struct changehdr */
+	int		 chfd;	/* -1 unless it exists */
+	struct sample	*chbuf;	/* changes not yet appended to it */
+	unsigned	 nch, maxch;
+	char		*kfn;	/* keys changed while copied */
+	int		 kfd;	/* -1 unless compact_run() runs */
+	u_int8_t	*kbuf;	/* keys not yet appended to it */
+	size_t		 nkbuf;
+};
+
+/* values in memory that force a flush of the journal */
+#define	MAX_MEM		65536
+
+static int	 data_attach(struct data *);
+static int	 data_detach(struct data *);
+static struct data *shard_get(struct data *, unsigned);
+static int	 shard_close(struct data *, unsigned);
+static unsigned	 shard_of(struct data *, unsigned);
+static int	 rollup(struct data *, unsigned, short, unsigned, int);
+
 extern int		 debug;
-static const char	*fn = NULL;
-static BTREEINFO	 btreeinfo;
-static DB		*db;
-static DBT		 dbk, dbd;
-static struct key	 k;
-static struct val	 v;
-static struct last	 l;
 
 #define	MAX_LEVEL	((u_int16_t)0xffffU)
 #define	MAX_TS		((u_int32_t)0xffffffffU)
+#define	MAX_UNIT	((u_int32_t)0xffffffffU)
+#define	SWAP32(x)	((x) >> 24 | ((x) >> 8 & 0xff00) | \
+			    ((x) << 8 & 0xff0000) | (x) << 24)
+
+/*
+ * Pack a key for a database of format f into buf, big endian so records
+ * sort by unit, level and time, and point dbk at it.
+ */
+static void
+key_pack(unsigned f, const struct key *k, u_int8_t *buf, DBT *dbk)
+{
+	u_int8_t *p = buf;
+
+	if (f >= 3) {
+		*p++ = k->unit >> 24;
+		*p++ = k->unit >> 16;
+	}
+	*p++ = k->unit >> 8;
+	*p++ = k->unit;
+	*p++ = k->level >> 8;
+	*p++ = k->level;
+	*p++ = k->ts >> 24;
+	*p++ = k->ts >> 16;
+	*p++ = k->ts >> 8;
+	*p++ = k->ts;
+	memset(dbk, 0, sizeof(*dbk));
+	dbk->size = p - buf;
+	dbk->data = buf;
+}
+
+/* unpack the key of a record of format f, fails for other records */
+static int
+key_unpack(unsigned f, const DBT *dbk, struct key *k)
+{
+	const u_int8_t *p = dbk->data;
+
+	if (p == NULL || dbk->size != KEY_SIZE(f))
+		return (1);
+	k->unit = 0;
+	if (f >= 3) {
+		k->unit = (u_int32_t)p[0] << 24 | (u_int32_t)p[1] << 16;
+		p += 2;
+	}
+	k->unit |= (u_int32_t)p[0] << 8 | p[1];
+	k->level = p[2] << 8 | p[3];
+	k->ts = (u_int32_t)p[4] << 24 | (u_int32_t)p[5] << 16 |
+	    (u_int32_t)p[6] << 8 | p[7];
+	/* the catalog of series names, see data_series() */
+	if (f >= 3 && k->unit == MAX_UNIT)
+		return (1);
+	return (0);
+}
+
+/* a key of the catalog, the unit MAX_UNIT followed by a name or not */
+static int
+key_catalog(unsigned f, const DBT *dbk)
+{
+	return (f >= 3 && dbk->data != NULL && dbk->size >= 4 &&
+	    !memcmp(dbk->data, "\xff\xff\xff\xff", 4));
+}
+
+/* a key of the snapshot index, or its marker */
+static int
+key_snap(unsigned f, const DBT *dbk)
+{
+	return (f >= 3 && dbk->data != NULL && dbk->size >= 4 &&
+	    !memcmp(dbk->data, "\xff\xff\xff\xfe", 4));
+}
+
+/* the key of the generation */
+static int
+key_gen(unsigned f, const DBT *dbk)
+{
+	return (f >= 3 && dbk->data != NULL && dbk->size == 4 &&
+	    !memcmp(dbk->data, "\xff\xff\xff\xfd", 4));
+}
+
+static void
+snap_pack(unsigned bucket, unsigned unit, u_int8_t *buf, DBT *dbk)
+{
+	u_int32_t x;
+
+	x = htonl(SNAP_UNIT);
+	memcpy(buf, &x, 4);
+	x = htonl(bucket);
+	memcpy(buf + 4, &x, 4);
+	x = htonl(unit);
+	memcpy(buf + 8, &x, 4);
+	memset(dbk, 0, sizeof(*dbk));
+	dbk->size = SNAP_KEY_SIZE;
+	dbk->data = buf;
+}
+
+static void
+snap_unpack(const DBT *dbk, unsigned *bucket, unsigned *unit)
+{
+	u_int32_t x;
+
+	memcpy(&x, (u_int8_t *)dbk->data + 4, 4);
+	*bucket = ntohl(x);
+	memcpy(&x, (u_int8_t *)dbk->data + 8, 4);
+	*unit = ntohl(x);
+}
+
+/* keys buffered before they are appended to the log of compact_run() */
+#define	KBUF_SIZE	8192
+
+/*
+ * While compact_run() copies the database, it holds an exclusive lock
+ * on the log of keys next to it, and writers append to it the key of
+ * every record they store or delete.  A log not locked is left over by one
+ * interrupted, and not appended to.
+ */
+static int
+compact_log_open(struct data *d)
+{
+	if ((d->kfd = open(d->kfn, O_WRONLY|O_APPEND)) == -1) {
+		if (errno == ENOENT)
+			return (0);
+		fprintf(stderr, "data_open: open: %s: %s\n", d->kfn,
+		    strerror(errno));
+		return (1);
+	}
+	if (!flock(d->kfd, LOCK_SH|LOCK_NB)) {
+		close(d->kfd);
+		d->kfd = -1;
+		return (0);
+	}
+	if (errno != EWOULDBLOCK || (d->kbuf == NULL &&
+	    (d->kbuf = malloc(KBUF_SIZE)) == NULL)) {
+		fprintf(stderr, "data_open: %s: %s\n", d->kfn,
+		    strerror(errno));
+		close(d->kfd);
+		d->kfd = -1;
+		return (1);
+	}
+	d->nkbuf = 0;
+	if (debug > 0)
+		printf("data_open: %s is compacted, logging keys\n", d->fn);
+	return (0);
+}
+
+/* append the buffered keys to the log, before the database is unlocked */
+static int
+compact_log_flush(struct data *d)
+{
+	ssize_t n;
+
+	if (d->kfd == -1 || !d->nkbuf)
+		return (0);
+	n = write(d->kfd, d->kbuf, d->nkbuf);
+	if (n != (ssize_t)d->nkbuf) {
+		fprintf(stderr, "compact_log_flush: write: %s: %s\n", d->kfn,
+		    n == -1 ? strerror(errno) : "short write");
+		if (n >= 0)
+			errno = ENOSPC;
+		return (1);
+	}
+	d->nkbuf = 0;
+	return (0);
+}
+
+/* log a key stored or deleted, a byte of its size followed by it */
+static int
+compact_log(struct data *d, const DBT *key)
+{
+	if (key->size > KEY_MAX) {
+		errno = EINVAL;
+		return (1);
+	}
+	if (d->nkbuf + 1 + key->size > KBUF_SIZE && compact_log_flush(d))
+		return (1);
+	d->kbuf[d->nkbuf++] = key->size;
+	memcpy(d->kbuf + d->nkbuf, key->data, key->size);
+	d->nkbuf += key->size;
+	return (0);
+}
+
+/* database access, counted for the statistics */
+static int
+dbseq(struct data *d, DBT *key, DBT *data, u_int flags)
+{
+	d->ops++;
+	return (d->db->seq(d->db, key, data, flags));
+}
+
+static int
+dbget(struct data *d, DBT *key, DBT *data, u_int flags)
+{
+	d->ops++;
+	return (d->db->get(d->db, key, data, flags));
+}
+
+static int
+dbput(struct data *d, DBT *key, DBT *data, u_int flags)
+{
+	d->ops++;
+	if (d->kfd != -1 && compact_log(d, key))
+		return (-1);
+	return (d->db->put(d->db, key, data, flags));
+}
+
+static int
+dbdel(struct data *d, DBT *key, u_int flags)
+{
+	d->ops++;
+	if (d->kfd != -1 && compact_log(d, key))
+		return (-1);
+	return (d->db->del(d->db, key, flags));
+}
+
+/* block reads of the process so far, from getrusage(2) */
+static long
+inblock(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return (0);
+	return (ru.ru_inblock);
+}
+
+/*
+ * Print database operations and block reads since ops and blocks.  The
+ * block reads are of the whole process and leave out those served from
+ * the buffer cache of the system, so they are no measure of hits in the
+ * cache of db(3), and the two are printed as they are.
+ */
+static void
+print_stats(const char *what, unsigned long ops, long blocks)
+{
+	printf("%s: %lu operations, %ld block reads\n", what, ops, blocks);
+}
 
 static short
-find_highest_level(unsigned short unit)
+find_highest_level(struct data *d, unsigned unit)
 {
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
 	int r;
 
-	memset(&k, 0, sizeof(k));
-	k.unit = htons(unit);
-	k.level = htons(MAX_LEVEL - 1);
-	memset(&dbk, 0, sizeof(dbk));
-	dbk.size = sizeof(k);
-	dbk.data = &k;
-	r = db->seq(db, &dbk, &dbd, R_CURSOR);
+	k.unit = unit;
+	k.level = MAX_LEVEL - 1;
+	k.ts = 0;
+	key_pack(d->format, &k, kb, &dbk);
+	r = dbseq(d, &dbk, &dbd, R_CURSOR);
 	if (!r)
-		r = db->seq(db, &dbk, &dbd, R_PREV);
+		r = dbseq(d, &dbk, &dbd, R_PREV);
 	else
-		r = db->seq(db, &dbk, &dbd, R_LAST);
-	if (r || dbk.size != sizeof(k) || !dbk.data)
-		return (0);
-	memcpy(&k, dbk.data, sizeof(k));
-	k.unit = ntohs(k.unit);
-	if (k.unit != unit)
+		r = dbseq(d, &dbk, &dbd, R_LAST);
+	if (r || key_unpack(d->format, &dbk, &k) || k.unit != unit)
 		return (0);
-	k.level = ntohs(k.level);
 	if (debug > 0)
 		printf("find_highest_level(unit %d) returning level %d\n",
 		    (int)unit, (int)k.level);
@@ -104,33 +516,30 @@ find_highest_level(unsigned short unit)
 }
 
 static unsigned
-find_highest_ts(unsigned short unit, short level)
+find_highest_ts(struct data *d, unsigned unit, short level)
 {
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
 	int r;
 
-	memset(&k, 0, sizeof(k));
-	k.unit = htons(unit);
-	k.level = htons(level);
-	k.ts = htonl(MAX_TS);
-	memset(&dbk, 0, sizeof(dbk));
-	dbk.size = sizeof(k);
-	dbk.data = &k;
+	k.unit = unit;
+	k.level = level;
+	k.ts = MAX_TS;
+	key_pack(d->format, &k, kb, &dbk);
 	if (debug > 1)
 		printf("find_highest_ts(unit %d, level %d) seeking\n",
 		    (int)unit, (int)level);
-	r = db->seq(db, &dbk, &dbd, R_CURSOR);
+	r = dbseq(d, &dbk, &dbd, R_CURSOR);
 	if (!r)
-		r = db->seq(db, &dbk, &dbd, R_PREV);
+		r = dbseq(d, &dbk, &dbd, R_PREV);
 	else
-		r = db->seq(db, &dbk, &dbd, R_LAST);
-	if (r || dbk.size != sizeof(k) || !dbk.data) {
+		r = dbseq(d, &dbk, &dbd, R_LAST);
+	if (r || key_unpack(d->format, &dbk, &k)) {
 		if (debug > 1)
 			printf("find_highest_ts: seek failed, returning 0\n");
 		return (0);
 	}
-	memcpy(&k, dbk.data, sizeof(k));
-	k.unit = ntohs(k.unit);
-	k.level = ntohs(k.level);
 	if (k.unit != unit || k.level != level) {
 		if (debug > 1)
 			printf("find_highest_ts: out of range "
@@ -138,614 +547,3616 @@ find_highest_ts(unsigned short unit, short level)
 			    (int)k.unit, (int)unit, (int)k.level, (int)level);
 		return (0);
 	}
-	k.ts = ntohl(k.ts);
 	if (debug > 0)
 		printf("find_highest_ts(unit %d, level %d) returning ts %u\n",
 		     (int)unit, (int)level, (unsigned)k.ts);
 	return ((unsigned)k.ts);
 }
 
+/*
+ * Width in seconds of the buckets compressed entries are rolled up into,
+ * per level.  Buckets are aligned to multiples of their width since the
+ * epoch, so all units share the same timestamps, and each width divides
+ * the next one.  Level 0 holds the uncompressed values.
+ */
+static const unsigned level_width[] = {
+	60,			/* nominal collect interval */
+	10 * 60,		/* 10 minutes */
+	2 * 60 * 60,		/* 2 hours */
+	24 * 60 * 60,		/* 1 day */
+	10 * 24 * 60 * 60	/* 10 days */
+};
+
+#define	NLEVELS		(sizeof(level_width) / sizeof(level_width[0]))
+
+/* check the size of the data of a record with a key in host order */
+static int
+record_valid(const struct key *k, const DBT *dbd)
+{
+	if (dbd->data == NULL)
+		return (0);
+	if (k->level == MAX_LEVEL)
+		return (dbd->size == (k->ts == MAX_TS ? sizeof(struct meta) :
+		    sizeof(struct last)));
+	return (dbd->size == VAL_SIZE_1 ||
+	    (k->level > 0 && dbd->size >= sizeof(struct val) &&
+	    (dbd->size - sizeof(struct val)) % sizeof(struct sketch_bin) == 0));
+}
+
+/*
+ * Read a value record.  A level 0 value counts once, a gap marker (NaN)
+ * not at all; for rollups of format 1 the count is estimated from the
+ * nominal collect interval.  Rollups may be followed by the buckets of
+ * a quantile sketch.
+ */
+static int
+get_val(const DBT *dbd, short level, struct val *v)
+{
+	if (dbd->data == NULL || (dbd->size != VAL_SIZE_1 &&
+	    (level == 0 || dbd->size < sizeof(*v))))
+		return (1);
+	memcpy(v, dbd->data, dbd->size < sizeof(*v) ? dbd->size : sizeof(*v));
+	if (dbd->size == VAL_SIZE_1 && isnan(v->avg))
+		v->count = v->sum = v->sumsq = 0.0;
+	else if (dbd->size == VAL_SIZE_1) {
+		v->count = level < NLEVELS ?
+		    level_width[level] / level_width[0] : 1;
+		v->sum = v->avg * v->count;
+		v->sumsq = v->avg * v->avg * v->count;
+	}
+	return (0);
+}
+
+/* add a value record to a sketch, with its buckets if it has some */
+static int
+sketch_record(struct sketch *sk, const DBT *dbd, const struct val *v)
+{
+	if (dbd->size > sizeof(*v))
+		return (sketch_merge(sk, (const char *)dbd->data + sizeof(*v),
+		    dbd->size - sizeof(*v)));
+	return (sketch_add(sk, v->avg, (unsigned)v->count));
+}
+
+/*
+ * Summarize the values of a level within beg-end: the time-weighted
+ * average, and the count, sum and squares of the values summarized.
+ * With sk, merge their sketches, or add the values without one.  Gap
+ * markers end the value before them and are not counted.
+ */
 static unsigned
-count_values(unsigned short unit, short level, unsigned ts,
-    double *min, double *avg, double *max)
+count_values(struct data *d, unsigned unit, short level, unsigned beg,
+    unsigned end, struct val *s, struct sketch *sk)
 {
-	unsigned count = 0;
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	struct val v;
+	unsigned count = 0, dur = 0;
 	int r;
-	unsigned tsp = ts;
-	double avgp = 0.0;
-
-	*min = DBL_MAX;
-	*max = -DBL_MAX;
-	*avg = 0.0;
+	unsigned tsp = beg;
+	double avgp = NAN;
 
-	memset(&k, 0, sizeof(k));
-	k.unit = htons(unit);
-	k.level = htons(level);
-	k.ts = htonl(ts);
+	memset(s, 0, sizeof(*s));
+	s->min = DBL_MAX;
+	s->max = -DBL_MAX;
 
-	memset(&dbk, 0, sizeof(dbk));
-	dbk.size = sizeof(k);
-	dbk.data = &k;
+	k.unit = unit;
+	k.level = level;
+	k.ts = beg;
+	key_pack(d->format, &k, kb, &dbk);
 
 	memset(&dbd, 0, sizeof(dbd));
 
-	for (r = db->seq(db, &dbk, &dbd, R_CURSOR); !r;
-	    r = db->seq(db, &dbk, &dbd, R_NEXT)) {
-		if (dbk.size != sizeof(k) || !dbk.data)
+	for (r = dbseq(d, &dbk, &dbd, R_CURSOR); !r;
+	    r = dbseq(d, &dbk, &dbd, R_NEXT)) {
+		if (key_unpack(d->format, &dbk, &k))
 			break;
-		memcpy(&k, dbk.data, sizeof(k));
-		k.unit = ntohs(k.unit);
-		k.level = ntohs(k.level);
-		k.ts = ntohl(k.ts);
-		if (k.unit != unit || k.level != level)
+		if (k.unit != unit || k.level != level || k.ts >= end)
 			break;
-		if (dbd.size != sizeof(v) || !dbd.data)
+		if (get_val(&dbd, level, &v))
 			break;
-		memcpy(&v, dbd.data, sizeof(v));
 
-		if (!ts)
-			ts = k.ts;
-		if (v.min < *min)
-			*min = v.min;
-		if (v.max > *max)
-			*max = v.max;
-		*avg += avgp * (k.ts - tsp);
+		if (!isnan(avgp)) {
+			s->avg += avgp * (k.ts - tsp);
+			dur += k.ts - tsp;
+		}
 		avgp = v.avg;
 		tsp = k.ts;
+		if (isnan(v.avg))
+			continue;
+		if (v.min < s->min)
+			s->min = v.min;
+		if (v.max > s->max)
+			s->max = v.max;
+		if (sk != NULL && sketch_record(sk, &dbd, &v))
+			break;
+		s->count += v.count;
+		s->sum += v.sum;
+		s->sumsq += v.sumsq;
 		count++;
 	}
-	if (count && tsp > ts)
-		*avg /= (tsp - ts);
+	/* the last value holds until the end of the range */
+	if (!isnan(avgp)) {
+		s->avg += avgp * (end - tsp);
+		dur += end - tsp;
+	}
+	if (dur)
+		s->avg /= dur;
 	if (debug > 1)
-		printf("count_values(unit %d, level %d, ts %u) returning "
-		    "count %u\n", (int)unit, (int)level, ts, count);
+		printf("count_values(unit %d, level %d, beg %u, end %u) "
+		    "returning count %u\n", (int)unit, (int)level, beg, end,
+		    count);
 	return (count);
 }
 
-static int
-put_value_internal(unsigned short unit, short level, unsigned ts,
-    double min, double avg, double max)
+/* find lowest ts of unit and level at or after beg, 0 if none */
+static unsigned
+find_next_ts(struct data *d, unsigned unit, short level,
+    unsigned beg)
 {
-	unsigned max_ts, count;
-
-	if (debug > 0)
-		printf("put_value_internal(unit %d, level %d, ts %u, min %.2f, "
-		    "avg %.2f, max %.2f)\n", (int)unit, (int)level, ts, min,
-		    avg, max);
-
-	memset(&k, 0, sizeof(k));
-	k.unit = htons(unit);
-	k.level = htons(level);
-	k.ts = htonl(ts);
-	memset(&dbk, 0, sizeof(dbk));
-	dbk.size = sizeof(k);
-	dbk.data = &k;
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	int r;
 
-	memset(&v, 0, sizeof(v));
-	v.min = min;
-	v.avg = avg;
-	v.max = max;
-	memset(&dbd, 0, sizeof(dbd));
-	dbd.size = sizeof(v);
-	dbd.data = &v;
+	k.unit = unit;
+	k.level = level;
+	k.ts = beg;
+	key_pack(d->format, &k, kb, &dbk);
+	r = dbseq(d, &dbk, &dbd, R_CURSOR);
+	if (r || key_unpack(d->format, &dbk, &k) || k.unit != unit ||
+	    k.level != level)
+		return (0);
+	return (k.ts);
+}
 
-	if (db->put(db, &dbk, &dbd, 0)) {
-		fprintf(stderr, "db->put: %s\n", strerror(errno));
-		return (1);
-	}
+/* find highest ts of unit and level at or before end, 0 if none */
+static unsigned
+find_prev_ts(struct data *d, unsigned unit, short level,
+    unsigned end)
+{
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	int r;
 
-	if (debug > 1)
-		printf("put_value_internal: inserted, checking next level %d\n",
-		    (int)(level + 1));
-	max_ts = find_highest_ts(unit, level + 1);
-	if (debug > 1)
-		printf("put_value_internal: next level %d max_ts %u\n",
-		    (int)(level + 1), max_ts);
-	count = count_values(unit, level, max_ts, &min, &avg, &max);
-	if (debug > 1)
-		printf("put_value_internal: %u values on level %d since %u\n",
-		    count, (int)level, max_ts);
-	if (count < 10) {
-		if (debug > 1)
-			printf("put_value_internal: count %u < 10\n", count);
+	k.unit = unit;
+	k.level = level;
+	k.ts = end;
+	key_pack(d->format, &k, kb, &dbk);
+	r = dbseq(d, &dbk, &dbd, R_CURSOR);
+	if (!r && !key_unpack(d->format, &dbk, &k) && k.unit == unit &&
+	    k.level == level && k.ts == end)
+		return (end);
+	if (!r)
+		r = dbseq(d, &dbk, &dbd, R_PREV);
+	else
+		r = dbseq(d, &dbk, &dbd, R_LAST);
+	if (r || key_unpack(d->format, &dbk, &k) || k.unit != unit ||
+	    k.level != level)
 		return (0);
-	}
-	if (debug > 1)
-		printf("put_value_internal: count %u >= 10\n", count);
-	return (put_value_internal(unit, level + 1, ts, min, avg, max));
+	return (k.ts);
 }
 
+/* index a value stored on level 0, if the database keeps the index */
 static int
-get_last(unsigned short unit, unsigned *since, unsigned *ts, double *val)
+snap_put(struct data *d, unsigned unit, unsigned ts, double val)
 {
-	int r;
+	u_int8_t kb[SNAP_KEY_SIZE];
+	DBT dbk, dbd;
+	struct snap sn;
 
-	memset(&k, 0, sizeof(k));
-	k.unit = htons(unit);
-	k.level = htons(MAX_LEVEL);
-	k.ts = htonl(0);
-	memset(&dbk, 0, sizeof(dbk));
-	dbk.size = sizeof(k);
-	dbk.data = &k;
+	if (!d->snap)
+		return (0);
+	snap_pack(ts - ts % level_width[0], unit, kb, &dbk);
+	memset(&sn, 0, sizeof(sn));
+	sn.ts = ts;
+	sn.val = val;
 	memset(&dbd, 0, sizeof(dbd));
-	r = db->get(db, &dbk, &dbd, 0);
-	if (r > 0)
-		/* key not found */
-		return (1);
-	if (r < 0) {
-		fprintf(stderr, "db->get: %s\n", strerror(errno));
+	dbd.size = sizeof(sn);
+	dbd.data = &sn;
+	if (dbput(d, &dbk, &dbd, 0)) {
+		fprintf(stderr, "snap_put: db->put: %s\n", strerror(errno));
 		return (1);
 	}
-	if (dbd.size != sizeof(l) || !dbd.data)
-		return (1);
-	memcpy(&l, dbd.data, sizeof(l));
-	*since = l.since;
-	*ts = l.ts;
-	*val = l.val;
-	if (debug > 0)
-		printf("get_last(unit %u) returns since %u, ts %u, val %.2f\n",
-		    (unsigned)unit, *since, *ts, *val);
 	return (0);
 }
 
 static int
-put_last(unsigned short unit, unsigned since, unsigned ts, double val)
+put_value_internal(struct data *d, unsigned unit, short level,
+    unsigned ts, const struct val *val, const struct sketch *sk, int flags)
 {
+	u_int8_t rec[sizeof(struct val) +
+	    SKETCH_MAX_BINS * sizeof(struct sketch_bin)];
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+
 	if (debug > 0)
-		printf("put_last(unit %u, since %u, ts %u, val %.2f)\n",
-		    (unsigned)unit, since, ts, val);
-	memset(&k, 0, sizeof(k));
-	k.unit = htons(unit);
-	k.level = htons(MAX_LEVEL);
-	k.ts = htonl(0);
-	memset(&dbk, 0, sizeof(dbk));
-	dbk.size = sizeof(k);
-	dbk.data = &k;
-	memset(&l, 0, sizeof(l));
-	l.since = since;
-	l.ts = ts;
-	l.val = val;
+		printf("put_value_internal(unit %d, level %d, ts %u, "
+		    "min %.2f, avg %.2f, max %.2f)\n", (int)unit, (int)level,
+		    ts, val->min, val->avg, val->max);
+
+	k.unit = unit;
+	k.level = level;
+	k.ts = ts;
+	key_pack(d->format, &k, kb, &dbk);
+
 	memset(&dbd, 0, sizeof(dbd));
-	dbd.size = sizeof(l);
-	dbd.data = &l;
-	if (db->put(db, &dbk, &dbd, 0)) {
+	dbd.size = level > 0 && d->format >= 2 ? sizeof(*val) : VAL_SIZE_1;
+	dbd.data = rec;
+	memcpy(rec, val, dbd.size);
+	if (dbd.size == sizeof(*val) && sk != NULL) {
+		memcpy(rec + dbd.size, sk->bin, sk->n * sizeof(*sk->bin));
+		dbd.size += sk->n * sizeof(*sk->bin);
+	}
+
+	if (dbput(d, &dbk, &dbd, 0)) {
 		fprintf(stderr, "db->put: %s\n", strerror(errno));
 		return (1);
 	}
-	return (0);
+	if (level == 0 && snap_put(d, unit, ts, val->avg))
+		return (1);
+	return (rollup(d, unit, level, ts, flags));
 }
 
-int
-data_put_value(unsigned since, unsigned ts, unsigned short unit, double val,
-    int tdiff, int vdiff)
+/*
+ * A value landing in a new bucket of the next level completes all
+ * buckets before it which have not been rolled up yet.
+ */
+static int
+rollup(struct data *d, unsigned unit, short level, unsigned ts, int flags)
 {
-	if (debug > 0)
-		printf("data_put_value(since %u, ts %u, unit %u, val %.2f, "
-		    "tdiff %d vdiff %d)\n", since, ts, (unsigned)unit, val, tdiff, vdiff);
-	if (tdiff || vdiff) {
-		/* find previous value and ts, calculate diff per second */
-		int skip = 1;
-		unsigned last_since, last_ts;
-		double last_val;
+	struct val v;
+	struct sketch sn;
+	unsigned width, bucket, beg, count;
+	int r = 0;
 
-		if (!get_last(unit, &last_since, &last_ts, &last_val) &&
-		    last_since == since && last_ts < ts && last_val <= val)
-			skip = 0;
-		put_last(unit, since, ts, val);
-		if (skip)
-			return (0);
-		if (tdiff)
-			val = (val - last_val) / (ts - last_ts);
-		if (vdiff)
-			val = val - last_val;
+	if (level + 1 >= NLEVELS)
+		return (0);
+	width = level_width[level + 1];
+	bucket = ts - ts % width;
+	beg = find_highest_ts(d, unit, level + 1);
+	if (beg)
+		beg = beg - beg % width + width;
+	if (debug > 1)
+		printf("rollup: next level %d rolled up before %u, "
+		    "bucket %u\n", (int)(level + 1), beg, bucket);
+	sketch_init(&sn);
+	while (beg < bucket) {
+		beg = find_next_ts(d, unit, level, beg);
+		if (!beg || beg >= bucket)
+			break;
+		beg -= beg % width;
+		sketch_reset(&sn);
+		count = count_values(d, unit, level, beg, beg + width, &v,
+		    flags & DATA_SKETCH ? &sn : NULL);
+		if (debug > 1)
+			printf("rollup: %u values on level %d "
+			    "in bucket %u\n", count, (int)level, beg);
+		if (count && put_value_internal(d, unit, level + 1, beg, &v,
+		    flags & DATA_SKETCH ? &sn : NULL, flags)) {
+			r = 1;
+			break;
+		}
+		beg += width;
 	}
-	return (put_value_internal(unit, 0, ts, val, val, val));
+	sketch_free(&sn);
+	return (r);
 }
 
-/* find highest level of unit with more than siz entries within beg-end */
+/*
+ * Map the table, grown to at least n slots unless read-only.  It is
+ * created when the first slot is needed.
+ */
 static int
-get_values_find_level(unsigned short unit, unsigned beg, unsigned end,
-    unsigned siz)
+last_map(struct lasttab *t, size_t n)
 {
-	short level = 0;
+	struct lhdr h;
+	struct stat st;
+	size_t size;
+	void *map;
 
-	/* find highest level at all */
-	level = find_highest_level(unit);
-	if (debug > 0)
-		printf("get_values_find_level: highest level overall is %d\n",
-		    (int)level);
-	while (level > 0) {
-		unsigned count = 0;
+	if (t->rdonly)
+		n = 0;
+	if (t->fd == -1) {
+		t->fd = open(t->fn, t->rdonly ? O_RDONLY :
+		    O_RDWR|(n ? O_CREAT : 0), 0600);
+		if (t->fd == -1) {
+			if (!n && errno == ENOENT)
+				return (0);
+			fprintf(stderr, "last_map: open: %s: %s\n", t->fn,
+			    strerror(errno));
+			return (1);
+		}
+	}
+	if (fstat(t->fd, &st)) {
+		fprintf(stderr, "last_map: fstat: %s: %s\n", t->fn,
+		    strerror(errno));
+		return (1);
+	}
+	size = st.st_size;
+	if (n && (size < sizeof(h) ||
+	    (size - sizeof(h)) / sizeof(struct last) < n)) {
+		if (n > (SIZE_MAX - sizeof(h)) / sizeof(struct last) -
+		    LAST_GROW) {
+			fprintf(stderr, "last_map: %s: %zu slots\n", t->fn, n);
+			return (1);
+		}
+		n = (n / LAST_GROW + 1) * LAST_GROW;
+		if (size < sizeof(h)) {
+			memset(&h, 0, sizeof(h));
+			h.magic = LAST_MAGIC;
+			h.size = sizeof(struct last);
+			if (pwrite(t->fd, &h, sizeof(h), 0) != sizeof(h)) {
+				fprintf(stderr, "last_map: write: %s: %s\n",
+				    t->fn, strerror(errno));
+				return (1);
+			}
+		}
+		size = sizeof(h) + n * sizeof(struct last);
+		if (ftruncate(t->fd, size)) {
+			fprintf(stderr, "last_map: ftruncate: %s: %s\n",
+			    t->fn, strerror(errno));
+			return (1);
+		}
+	}
+	/* created by a writer that has not written the header yet */
+	if (size < sizeof(h) || size == t->size)
+		return (0);
+	map = mmap(NULL, size, t->rdonly ? PROT_READ : PROT_READ|PROT_WRITE,
+	    MAP_SHARED, t->fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "last_map: mmap: %s: %s\n", t->fn,
+		    strerror(errno));
+		return (1);
+	}
+	memcpy(&h, map, sizeof(h));
+	if (h.magic != LAST_MAGIC || h.size != sizeof(struct last)) {
+		fprintf(stderr, "last_map: %s: not a table of last values\n",
+		    t->fn);
+		munmap(map, size);
+		return (1);
+	}
+	if (t->map != NULL)
+		munmap(t->map, t->size);
+	t->map = map;
+	t->size = size;
+	t->slot = (struct last *)((char *)map + sizeof(h));
+	t->nslot = (size - sizeof(h)) / sizeof(struct last);
+	return (0);
+}
+
+static int
+last_open(struct lasttab *t, const char *filename, int rdonly)
+{
+	size_t len;
+
+	memset(t, 0, sizeof(*t));
+	t->fd = -1;
+	t->rdonly = rdonly;
+	len = strlen(filename) + sizeof(".last");
+	if ((t->fn = malloc(len)) == NULL) {
+		fprintf(stderr, "last_open: malloc: %s\n", strerror(errno));
+		return (1);
+	}
+	snprintf(t->fn, len, "%s.last", filename);
+	return (last_map(t, 0));
+}
+
+static int
+last_sync(struct lasttab *t)
+{
+	if (t->map == NULL || t->rdonly)
+		return (0);
+	if (msync(t->map, t->size, MS_SYNC)) {
+		fprintf(stderr, "last_sync: msync: %s: %s\n", t->fn,
+		    strerror(errno));
+		return (1);
+	}
+	return (0);
+}
+
+static void
+last_close(struct lasttab *t)
+{
+	if (t->fn == NULL)
+		return;
+	last_sync(t);
+	if (t->map != NULL)
+		munmap(t->map, t->size);
+	if (t->fd != -1)
+		close(t->fd);
+	free(t->fn);
+	memset(t, 0, sizeof(*t));
+	t->fd = -1;
+}
+
+/* the slot of unit, NULL if beyond the table and not grow */
+static struct last *
+last_slot(struct lasttab *t, unsigned unit, int grow)
+{
+	if (unit >= t->nslot && last_map(t, grow ? (size_t)unit + 1 : 0))
+		return (NULL);
+	return (unit < t->nslot ? &t->slot[unit] : NULL);
+}
+
+/*
+ * Move the last value of a record stored before the table into it,
+ * unless the table has a later one or it is older than cutoff.
+ * Returns 1 for such a record.
+ */
+static int
+last_migrate(struct lasttab *t, unsigned f, const DBT *key,
+    const DBT *data, unsigned cutoff)
+{
+	struct key k;
+	struct last l, *s;
+
+	if (key_unpack(f, key, &k) || k.level != MAX_LEVEL ||
+	    k.ts == MAX_TS)
+		return (0);
+	if (data->size != sizeof(l) || data->data == NULL || t->rdonly)
+		return (1);
+	memcpy(&l, data->data, sizeof(l));
+	if (l.ts >= cutoff && (s = last_slot(t, k.unit, 1)) != NULL &&
+	    s->ts < l.ts)
+		*s = l;
+	return (1);
+}
+
+/*
+ * Forget the last values older than cutoff, as data_truncate() used to
+ * delete their records, so that the first value of a unit after a long
+ * outage starts its differences anew.
+ */
+static void
+last_expire(struct lasttab *t, unsigned cutoff)
+{
+	size_t i;
+
+	if (t->rdonly)
+		return;
+	for (i = 0; i < t->nslot; ++i)
+		if (t->slot[i].ts && t->slot[i].ts < cutoff)
+			memset(&t->slot[i], 0, sizeof(t->slot[i]));
+}
+
+static int
+get_last(struct data *d, unsigned unit, unsigned *since, unsigned *ts,
+    double *val)
+{
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	struct last l, *s;
+	int r;
+
+	if ((s = last_slot(&d->lt, unit, 0)) != NULL && s->ts)
+		l = *s;
+	else {
+		/* stored before the table, until moved into it */
+		k.unit = unit;
+		k.level = MAX_LEVEL;
+		k.ts = 0;
+		key_pack(d->format, &k, kb, &dbk);
+		memset(&dbd, 0, sizeof(dbd));
+		r = dbget(d, &dbk, &dbd, 0);
+		if (r > 0)
+			/* key not found */
+			return (1);
+		if (r < 0) {
+			fprintf(stderr, "db->get: %s\n", strerror(errno));
+			return (1);
+		}
+		if (dbd.size != sizeof(l) || !dbd.data)
+			return (1);
+		memcpy(&l, dbd.data, sizeof(l));
+	}
+	*since = l.since;
+	*ts = l.ts;
+	*val = l.val;
+	if (debug > 0)
+		printf("get_last(unit %u) returns since %u, ts %u, val %.2f\n",
+		    (unsigned)unit, *since, *ts, *val);
+	return (0);
+}
+
+static int
+put_last(struct data *d, unsigned unit, unsigned since, unsigned ts,
+    double val)
+{
+	struct last *s;
+
+	if (debug > 0)
+		printf("put_last(unit %u, since %u, ts %u, val %.2f)\n",
+		    (unsigned)unit, since, ts, val);
+	if ((s = last_slot(&d->lt, unit, 1)) == NULL)
+		return (1);
+	s->since = since;
+	s->ts = ts;
+	s->val = val;
+	return (0);
+}
+
+/* the generation of the values stored, 0 before format 3 */
+static int
+gen_get(struct data *d, unsigned *gen)
+{
+	DBT dbk, dbd;
+	u_int32_t g;
+	int r;
+
+	*gen = 0;
+	if (d->format < 3)
+		return (0);
+	memset(&dbk, 0, sizeof(dbk));
+	dbk.size = 4;
+	dbk.data = "\xff\xff\xff\xfd";
+	memset(&dbd, 0, sizeof(dbd));
+	if ((r = dbget(d, &dbk, &dbd, 0)) < 0) {
+		fprintf(stderr, "gen_get: db->get: %s\n", strerror(errno));
+		return (1);
+	}
+	if (!r && dbd.size == sizeof(g) && dbd.data != NULL) {
+		memcpy(&g, dbd.data, sizeof(g));
+		*gen = ntohl(g);
+	}
+	return (0);
+}
+
+static int
+gen_bump(struct data *d)
+{
+	DBT dbk, dbd;
+	unsigned gen;
+	u_int32_t g;
+
+	if (d->format < 3)
+		return (0);
+	if (gen_get(d, &gen))
+		return (1);
+	g = htonl(gen + 1);
+	memset(&dbk, 0, sizeof(dbk));
+	dbk.size = 4;
+	dbk.data = "\xff\xff\xff\xfd";
+	memset(&dbd, 0, sizeof(dbd));
+	dbd.size = sizeof(g);
+	dbd.data = &g;
+	if (dbput(d, &dbk, &dbd, 0)) {
+		fprintf(stderr, "gen_bump: db->put: %s\n", strerror(errno));
+		return (1);
+	}
+	if (debug > 0)
+		printf("gen_bump: generation %u\n", gen + 1);
+	return (0);
+}
+
+/*
+ * End the last value of unit before ts with a gap marker when it is
+ * older than the gap allowed, so a missed collect is left blank instead
+ * of being filled with the value before it.
+ */
+static int
+put_gap(struct data *d, unsigned unit, unsigned ts, int flags)
+{
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	struct val v;
+	int r;
+
+	if (!d->conf.gap)
+		return (0);
+	k.unit = unit;
+	k.level = 0;
+	k.ts = ts;
+	key_pack(d->format, &k, kb, &dbk);
+	r = dbseq(d, &dbk, &dbd, R_CURSOR);
+	if (!r)
+		r = dbseq(d, &dbk, &dbd, R_PREV);
+	else
+		r = dbseq(d, &dbk, &dbd, R_LAST);
+	if (r || key_unpack(d->format, &dbk, &k) || k.unit != unit ||
+	    k.level != 0 || get_val(&dbd, 0, &v) || isnan(v.avg))
+		return (0);
+	if (k.ts >= ts || ts - k.ts <= d->conf.gap)
+		return (0);
+	if (debug > 0)
+		printf("put_gap(unit %u): gap after ts %u\n", (unsigned)unit,
+		    (unsigned)k.ts);
+	v.min = v.avg = v.max = NAN;
+	return (put_value_internal(d, unit, 0, k.ts + d->conf.gap, &v, NULL,
+	    flags));
+}
+
+/*
+ * Store a value at level 0.  NaN stores a gap marker, which leaves the
+ * last value of a differential unit alone, so the next value is taken
+ * relative to the one before the gap.
+ */
+static int
+put_value(struct data *d, unsigned since, unsigned ts,
+    unsigned unit, double val, int flags)
+{
+	struct val v;
+
+	if (debug > 0)
+		printf("data_put_value(since %u, ts %u, unit %u, val %.2f, "
+		    "flags %d)\n", since, ts, (unsigned)unit, val, flags);
+	if (put_gap(d, unit, ts, flags))
+		return (1);
+	if (!isnan(val) && (flags & (DATA_TDIFF | DATA_VDIFF))) {
+		/* find previous value and ts, calculate diff per second */
+		int skip = 1;
+		unsigned last_since, last_ts;
+		double last_val;
+
+		if (!get_last(d, unit, &last_since, &last_ts, &last_val) &&
+		    last_since == since && last_ts < ts && last_val <= val)
+			skip = 0;
+		put_last(d, unit, since, ts, val);
+		if (skip)
+			return (0);
+		if (flags & DATA_TDIFF)
+			val = (val - last_val) / (ts - last_ts);
+		if (flags & DATA_VDIFF)
+			val = val - last_val;
+	}
+	v.min = v.avg = v.max = v.sum = val;
+	v.count = 1.0;
+	v.sumsq = val * val;
+	/* a value filled in, changing pixels cached before */
+	if (d->format >= 3 && ts <= find_highest_ts(d, unit, 0) &&
+	    gen_bump(d))
+		return (1);
+	return (put_value_internal(d, unit, 0, ts, &v, NULL, flags));
+}
+
+/* order values by key, keeping the order of puts to the same key */
+static int
+sample_cmp(const void *a, const void *b)
+{
+	const struct sample *x = a, *y = b;
+
+	if (x->unit != y->unit)
+		return (x->unit < y->unit ? -1 : 1);
+	if (x->ts != y->ts)
+		return (x->ts < y->ts ? -1 : 1);
+	return (x->seq < y->seq ? -1 : x->seq > y->seq);
+}
+
+static int
+mem_cmp(struct mem *a, struct mem *b)
+{
+	return (sample_cmp(&a->s, &b->s));
+}
+
+RB_GENERATE_STATIC(memtree, mem, entry, mem_cmp)
+
+static int
+mem_insert(struct data *d, const struct sample *s)
+{
+	struct mem *m;
+
+	if ((m = malloc(sizeof(*m))) == NULL) {
+		fprintf(stderr, "mem_insert: malloc: %s\n", strerror(errno));
+		return (1);
+	}
+	m->s = *s;
+	m->s.seq = d->seq++;
+	RB_INSERT(memtree, &d->mem, m);
+	d->nmem++;
+	return (0);
+}
+
+static void
+mem_clear(struct data *d)
+{
+	struct mem *m;
+
+	while ((m = RB_MIN(memtree, &d->mem)) != NULL) {
+		RB_REMOVE(memtree, &d->mem, m);
+		free(m);
+	}
+	d->nmem = 0;
+}
+
+/* append a value to the arrays of mem_values() */
+static int
+mem_append(unsigned **ts, double **val, unsigned *n, unsigned *max,
+    unsigned t, double x)
+{
+	unsigned *tn;
+	double *vn;
+
+	if (*n == *max) {
+		*max = *max ? 2 * *max : 64;
+		if ((tn = reallocarray(*ts, *max, sizeof(*tn))) != NULL)
+			*ts = tn;
+		if (tn == NULL || (vn = reallocarray(*val, *max,
+		    sizeof(*vn))) == NULL) {
+			fprintf(stderr, "mem_values: reallocarray: %s\n",
+			    strerror(errno));
+			return (1);
+		}
+		*val = vn;
+	}
+	(*ts)[*n] = t;
+	(*val)[(*n)++] = x;
+	return (0);
+}
+
+/*
+ * Values of unit still in the journal, as they will be stored: the
+ * differential ones relative to the last value in the database, with
+ * the gap markers put_gap() will add.
+ */
+static int
+mem_values(struct data *d, unsigned unit, unsigned **ts, double **val,
+    unsigned *n)
+{
+	struct mem *m, key;
+	unsigned last_since = 0, last_ts = 0, max = 0, tp;
+	double last_val = 0.0, x, xp = 0.0;
+	int have;
+
+	*ts = NULL;
+	*val = NULL;
+	*n = 0;
+	memset(&key, 0, sizeof(key));
+	key.s.unit = unit;
+	have = !get_last(d, unit, &last_since, &last_ts, &last_val);
+	tp = d->conf.gap ? find_highest_ts(d, unit, 0) : 0;
+	for (m = RB_NFIND(memtree, &d->mem, &key); m != NULL &&
+	    m->s.unit == unit; m = RB_NEXT(memtree, &d->mem, m)) {
+		if (tp && !isnan(xp) && m->s.ts > tp &&
+		    m->s.ts - tp > d->conf.gap) {
+			if (mem_append(ts, val, n, &max, tp + d->conf.gap,
+			    NAN))
+				goto fail;
+			xp = NAN;
+		}
+		x = m->s.val;
+		if (!isnan(x) && (m->s.flags & (DATA_TDIFF | DATA_VDIFF))) {
+			int skip = !have || last_since != m->s.since ||
+			    last_ts >= m->s.ts || last_val > x;
+
+			if (!skip && (m->s.flags & DATA_TDIFF))
+				x = (x - last_val) / (m->s.ts - last_ts);
+			if (!skip && (m->s.flags & DATA_VDIFF))
+				x = x - last_val;
+			have = 1;
+			last_since = m->s.since;
+			last_ts = m->s.ts;
+			last_val = m->s.val;
+			if (skip)
+				continue;
+		}
+		if (mem_append(ts, val, n, &max, m->s.ts, x))
+			goto fail;
+		tp = m->s.ts;
+		xp = x;
+	}
+	return (0);
+fail:
+	free(*ts);
+	free(*val);
+	*ts = NULL;
+	*val = NULL;
+	return (1);
+}
+
+static int
+journal_put(struct data *d, const struct sample *s)
+{
+	ssize_t n;
+
+	flock(d->jfd, LOCK_EX);
+	n = write(d->jfd, s, sizeof(*s));
+	flock(d->jfd, LOCK_UN);
+	if (n != sizeof(*s)) {
+		fprintf(stderr, "journal_put: write: %s: %s\n", d->jfn,
+		    n == -1 ? strerror(errno) : "short write");
+		return (1);
+	}
+	return (mem_insert(d, s));
+}
+
+/*
+ * Apply the values of the journal in key order and empty it once the
+ * database is synced.  Like readers, lock the database before the
+ * journal.
+ */
+static int
+journal_flush(struct data *d)
+{
+	struct mem *m;
+	int r = 0;
+
+	if (d->db == NULL && data_attach(d))
+		return (1);
+	flock(d->jfd, LOCK_EX);
+	if (debug > 0)
+		printf("journal_flush: %u values\n", d->nmem);
+	RB_FOREACH(m, memtree, &d->mem)
+		if (put_value(d, m->s.since, m->s.ts, m->s.unit, m->s.val,
+		    m->s.flags))
+			r = 1;
+	mem_clear(d);
+	if (last_sync(&d->lt))
+		r = 1;
+	if (data_detach(d))
+		r = 1;
+	if (!r && ftruncate(d->jfd, 0)) {
+		fprintf(stderr, "journal_flush: ftruncate: %s: %s\n", d->jfn,
+		    strerror(errno));
+		r = 1;
+	}
+	flock(d->jfd, LOCK_UN);
+	d->flushed = time(NULL);
+	return (r);
+}
+
+/* load the values of the journal left by a writer */
+static int
+journal_load(struct data *d)
+{
+	struct sample s;
+	FILE *f;
+
+	if ((f = fopen(d->jfn, "r")) == NULL)
+		return (errno == ENOENT ? 0 : 1);
+	flock(fileno(f), LOCK_SH);
+	/* a partial record at the end is from an interrupted write */
+	while (fread(&s, sizeof(s), 1, f) == 1)
+		if (mem_insert(d, &s)) {
+			fclose(f);
+			return (1);
+		}
+	fclose(f);
+	if (debug > 0 && d->nmem)
+		printf("journal_load: %s: %u values\n", d->jfn, d->nmem);
+	return (0);
+}
+
+/*
+ * Store values in the journal and memory instead of the database,
+ * which is only locked to flush them every flush seconds.  Values
+ * left by a previous writer are flushed first.
+ */
+int
+data_journal_open(struct data *d, int flush)
+{
+	unsigned i;
+
+	if (d->shard != NULL) {
+		d->flush = flush;
+		for (i = 0; i < d->conf.shards; ++i)
+			if (d->shard[i] != NULL &&
+			    data_journal_open(d->shard[i], flush))
+				return (1);
+		return (0);
+	}
+	if (d->rdonly) {
+		fprintf(stderr, "data_journal_open: %s: read-only\n", d->fn);
+		return (1);
+	}
+	d->jfd = open(d->jfn, O_WRONLY|O_CREAT|O_APPEND, 0600);
+	if (d->jfd == -1) {
+		fprintf(stderr, "data_journal_open: open: %s: %s\n", d->jfn,
+		    strerror(errno));
+		return (1);
+	}
+	d->flush = flush;
+	if (d->nmem)
+		return (journal_flush(d));
+	d->flushed = time(NULL);
+	return (data_detach(d));
+}
+
+/* flush the remaining values and lock the database again */
+int
+data_journal_close(struct data *d)
+{
+	unsigned i;
+	int r = 0;
+
+	if (d->shard != NULL) {
+		d->flush = 0;
+		for (i = 0; i < d->conf.shards; ++i)
+			if (d->shard[i] != NULL &&
+			    data_journal_close(d->shard[i]))
+				r = 1;
+		return (r);
+	}
+	if (d->jfd == -1)
+		return (0);
+	if (d->nmem && journal_flush(d))
+		r = 1;
+	close(d->jfd);
+	d->jfd = -1;
+	if (data_attach(d))
+		return (1);
+	return (r);
+}
+
+/*
+ * Open the log of changes of a database or a set of shards, created
+ * with conf.changes.  Once it exists, every value stored is appended.
+ */
+static int
+change_open(struct data *d)
+{
+	struct changehdr h;
+	struct stat st;
+	size_t len;
+	ssize_t n;
+
+	d->chfd = -1;
+	len = strlen(d->fn) + sizeof(".changes");
+	if ((d->chfn = malloc(len)) == NULL) {
+		fprintf(stderr, "change_open: malloc: %s\n", strerror(errno));
+		return (1);
+	}
+	snprintf(d->chfn, len, "%s.changes", d->fn);
+	d->chfd = open(d->chfn, d->rdonly ? O_RDONLY :
+	    O_RDWR|O_APPEND|(d->conf.changes ? O_CREAT : 0), 0600);
+	if (d->chfd == -1) {
+		if (errno == ENOENT)
+			return (0);
+		fprintf(stderr, "change_open: open: %s: %s\n", d->chfn,
+		    strerror(errno));
+		return (1);
+	}
+	if (d->rdonly)
+		return (0);
+	flock(d->chfd, LOCK_EX);
+	if (fstat(d->chfd, &st) == 0 && st.st_size == 0) {
+		memset(&h, 0, sizeof(h));
+		h.magic = CHANGES_MAGIC;
+		h.size = sizeof(struct sample);
+		n = write(d->chfd, &h, sizeof(h));
+	} else
+		n = pread(d->chfd, &h, sizeof(h), 0);
+	flock(d->chfd, LOCK_UN);
+	if (n != sizeof(h) || h.magic != CHANGES_MAGIC ||
+	    h.size != sizeof(struct sample)) {
+		fprintf(stderr, "change_open: %s: not a log of changes\n",
+		    d->chfn);
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Read the header of the log, and the sequence number of its last
+ * change into *last.  A partial sample at the end, being appended, is
+ * not counted.
+ */
+static int
+change_header(struct data *d, struct changehdr *h, u_int64_t *last)
+{
+	struct stat st;
+
+	if (fstat(d->chfd, &st)) {
+		fprintf(stderr, "change_header: fstat: %s: %s\n", d->chfn,
+		    strerror(errno));
+		return (1);
+	}
+	if (pread(d->chfd, h, sizeof(*h), 0) != sizeof(*h) ||
+	    h->magic != CHANGES_MAGIC || h->size != sizeof(struct sample)) {
+		fprintf(stderr, "change_header: %s: not a log of changes\n",
+		    d->chfn);
+		return (1);
+	}
+	*last = h->base + (st.st_size - sizeof(*h)) / sizeof(struct sample);
+	return (0);
+}
+
+/*
+ * Append the queued changes in one write under the lock of the log,
+ * which numbers them.  A short write is cut off again so later changes
+ * stay aligned.
+ */
+static int
+change_flush(struct data *d)
+{
+	size_t len = d->nch * sizeof(*d->chbuf);
+	struct stat st;
+	ssize_t n;
+	int r = 0;
+
+	if (d->chfd == -1 || !d->nch)
+		return (0);
+	flock(d->chfd, LOCK_EX);
+	if (fstat(d->chfd, &st)) {
+		n = -1;
+		r = 1;
+	} else if ((n = write(d->chfd, d->chbuf, len)) != (ssize_t)len) {
+		if (n > 0)
+			(void)ftruncate(d->chfd, st.st_size);
+		r = 1;
+	}
+	flock(d->chfd, LOCK_UN);
+	if (debug > 0)
+		printf("change_flush: %u changes\n", d->nch);
+	d->nch = 0;
+	if (r)
+		fprintf(stderr, "change_flush: write: %s: %s\n", d->chfn,
+		    n == -1 ? strerror(errno) : "short write");
+	return (r);
+}
+
+/* queue a stored value, appended with the batch or right away */
+static int
+change_add(struct data *d, unsigned since, unsigned ts, unsigned unit,
+    double val, int flags)
+{
+	struct sample *s;
+
+	if (d->nch == d->maxch) {
+		unsigned n = d->maxch ? 2 * d->maxch : 64;
+
+		if ((s = reallocarray(d->chbuf, n, sizeof(*s))) == NULL) {
+			fprintf(stderr, "change_add: reallocarray: %s\n",
+			    strerror(errno));
+			return (1);
+		}
+		d->chbuf = s;
+		d->maxch = n;
+	}
+	s = &d->chbuf[d->nch++];
+	memset(s, 0, sizeof(*s));
+	s->since = since;
+	s->ts = ts;
+	s->unit = unit;
+	s->flags = flags;
+	s->val = val;
+	return (d->batching ? 0 : change_flush(d));
+}
+
+/*
+ * Drop the changes before the first one at or after cutoff, moving the
+ * rest to the front of the log, and count them into its base.  Writers
+ * wait for the lock meanwhile.  The log is written through a second
+ * descriptor, as an offset is ignored for one opened for appending.
+ */
+static int
+change_trim(struct data *d, unsigned cutoff)
+{
+	struct sample buf[1024];
+	struct changehdr h;
+	u_int64_t last, drop = 0;
+	off_t from, to;
+	ssize_t n;
+	size_t i;
+	int fd, r = 1;
+
+	if (d->chfd == -1 || d->rdonly)
+		return (0);
+	if ((fd = open(d->chfn, O_RDWR)) == -1) {
+		fprintf(stderr, "change_trim: open: %s: %s\n", d->chfn,
+		    strerror(errno));
+		return (1);
+	}
+	flock(d->chfd, LOCK_EX);
+	if (change_header(d, &h, &last))
+		goto done;
+	for (from = sizeof(h); drop < last - h.base; from += n) {
+		if ((n = pread(fd, buf, sizeof(buf), from)) <= 0)
+			goto fail;
+		for (i = 0; i < n / sizeof(*buf) && buf[i].ts < cutoff; ++i)
+			drop++;
+		if (i < n / sizeof(*buf))
+			break;
+	}
+	if (debug > 0)
+		printf("change_trim: %llu of %llu changes dropped\n",
+		    (unsigned long long)drop,
+		    (unsigned long long)(last - h.base));
+	if (!drop) {
+		r = 0;
+		goto done;
+	}
+	from = sizeof(h) + drop * sizeof(*buf);
+	for (to = sizeof(h); (n = pread(fd, buf, sizeof(buf), from)) > 0;
+	    from += n, to += n)
+		if (pwrite(fd, buf, n, to) != n)
+			goto fail;
+	if (n < 0 || ftruncate(fd, to))
+		goto fail;
+	h.base += drop;
+	if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h))
+		goto fail;
+	r = 0;
+	goto done;
+
+fail:
+	fprintf(stderr, "change_trim: %s: %s\n", d->chfn, strerror(errno));
+done:
+	flock(d->chfd, LOCK_UN);
+	close(fd);
+	return (r);
+}
+
+static void
+change_close(struct data *d)
+{
+	if (d->chfd != -1) {
+		if (change_flush(d))
+			fprintf(stderr, "data_close: change_flush() failed\n");
+		close(d->chfd);
+	}
+	free(d->chfn);
+	free(d->chbuf);
+}
+
+/* units beyond 16 bit need keys of format 3 */
+static int
+unit_check(struct data *d, unsigned unit)
+{
+	if (unit < GEN_UNIT && (d->format >= 3 || unit <= 0xffff))
+		return (0);
+	fprintf(stderr, "%s: unit %u not supported by format %u\n", d->fn,
+	    unit, d->format);
+	return (1);
+}
+
+/* FNV-1a hash of a series name */
+static unsigned
+name_hash(const char *name)
+{
+	unsigned h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (u_int8_t)*name++) * 16777619U;
+	return (h);
+}
+
+static struct name *
+name_find(struct data *d, const char *name)
+{
+	struct name *n;
+
+	if (!d->maxnames)
+		return (NULL);
+	for (n = d->names[name_hash(name) & (d->maxnames - 1)]; n != NULL;
+	    n = n->next)
+		if (!strcmp(n->name, name))
+			return (n);
+	return (NULL);
+}
+
+/* cache a series name, doubling the table when it is full */
+static int
+name_add(struct data *d, const char *name, unsigned unit)
+{
+	struct name *n, *next, **t;
+	size_t len = strlen(name);
+	unsigned i, max, h;
+
+	if (d->nnames >= d->maxnames) {
+		max = d->maxnames ? 2 * d->maxnames : 256;
+		if ((t = calloc(max, sizeof(*t))) == NULL)
+			goto fail;
+		for (i = 0; i < d->maxnames; ++i)
+			for (n = d->names[i]; n != NULL; n = next) {
+				next = n->next;
+				h = name_hash(n->name) & (max - 1);
+				n->next = t[h];
+				t[h] = n;
+			}
+		free(d->names);
+		d->names = t;
+		d->maxnames = max;
+	}
+	if ((n = malloc(sizeof(*n) + len + 1)) == NULL)
+		goto fail;
+	memcpy(n->name, name, len + 1);
+	n->unit = unit;
+	h = name_hash(name) & (d->maxnames - 1);
+	n->next = d->names[h];
+	d->names[h] = n;
+	d->nnames++;
+	return (0);
+
+fail:
+	fprintf(stderr, "data_series: malloc: %s\n", strerror(errno));
+	return (1);
+}
+
+static void
+name_clear(struct data *d)
+{
+	struct name *n, *next;
+	unsigned i;
+
+	for (i = 0; i < d->maxnames; ++i)
+		for (n = d->names[i]; n != NULL; n = next) {
+			next = n->next;
+			free(n);
+		}
+	free(d->names);
+	d->names = NULL;
+	d->nnames = d->maxnames = 0;
+}
+
+/* get the catalog record of name, or with name NULL the next unit */
+static int
+catalog_get(struct data *d, const char *name, unsigned *unit)
+{
+	u_int8_t kb[KEY_MAX];
+	u_int32_t u;
+	size_t len = name != NULL ? strlen(name) : 0;
+	DBT dbk, dbd;
+	int r;
+
+	memset(kb, 0xff, 4);
+	if (len)
+		memcpy(kb + 4, name, len);
+	memset(&dbk, 0, sizeof(dbk));
+	dbk.size = 4 + len;
+	dbk.data = kb;
+	memset(&dbd, 0, sizeof(dbd));
+	if ((r = dbget(d, &dbk, &dbd, 0)) < 0) {
+		fprintf(stderr, "data_series: db->get: %s\n", strerror(errno));
+		return (-1);
+	}
+	if (r || dbd.size != sizeof(u) || dbd.data == NULL)
+		return (1);
+	memcpy(&u, dbd.data, sizeof(u));
+	*unit = ntohl(u);
+	return (0);
+}
+
+static int
+catalog_put(struct data *d, const char *name, unsigned unit)
+{
+	u_int8_t kb[KEY_MAX];
+	u_int32_t u = htonl(unit);
+	size_t len = name != NULL ? strlen(name) : 0;
+	DBT dbk, dbd;
+
+	memset(kb, 0xff, 4);
+	if (len)
+		memcpy(kb + 4, name, len);
+	memset(&dbk, 0, sizeof(dbk));
+	dbk.size = 4 + len;
+	dbk.data = kb;
+	memset(&dbd, 0, sizeof(dbd));
+	dbd.size = sizeof(u);
+	dbd.data = &u;
+	if (dbput(d, &dbk, &dbd, 0)) {
+		fprintf(stderr, "data_series: db->put: %s\n", strerror(errno));
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Find the unit of a series name, assigning the next free one to a new
+ * name if create is set, failing for it otherwise.  The catalog is kept
+ * in the database, of the first shard of a set, under the unit MAX_UNIT
+ * followed by the name, the key of the unit alone holding the next unit
+ * to assign.  Names looked up once are found in a hash table after.
+ */
+int
+data_series(struct data *d, const char *name, unsigned *unit, int create)
+{
+	struct name *n;
+	size_t len = strlen(name);
+	unsigned next;
+	int r, attached = 0;
+
+	if (d->shard != NULL)
+		return ((d = shard_get(d, 0)) == NULL ? 1 :
+		    data_series(d, name, unit, create));
+	if ((n = name_find(d, name)) != NULL) {
+		*unit = n->unit;
+		return (0);
+	}
+	if (len == 0 || len > DATA_NAME_MAX) {
+		fprintf(stderr, "data_series: invalid name length %zu\n", len);
+		return (1);
+	}
+	if (d->db == NULL) {
+		if (data_attach(d))
+			return (1);
+		attached = 1;
+	}
+	if (d->format < 3) {
+		fprintf(stderr, "data_series: %s: no series names in format "
+		    "%u, copy or compact the database\n", d->fn, d->format);
+		r = 1;
+		goto done;
+	}
+	if ((r = catalog_get(d, name, unit)) <= 0 || d->rdonly || !create) {
+		if (r > 0)
+			fprintf(stderr, "data_series: %s: unknown series %s\n",
+			    d->fn, name);
+		r = r != 0;
+		goto done;
+	}
+	if ((r = catalog_get(d, NULL, &next)) < 0)
+		goto done;
+	if (r)
+		next = NAMED_UNIT;
+	if (next >= GEN_UNIT) {
+		fprintf(stderr, "data_series: %s: out of units\n", d->fn);
+		r = 1;
+		goto done;
+	}
+	*unit = next;
+	r = catalog_put(d, name, next) || catalog_put(d, NULL, next + 1);
+	if (debug > 0)
+		printf("data_series: %s assigned unit %u\n", name, next);
+done:
+	if (!r)
+		r = name_add(d, name, *unit);
+	if (attached && data_detach(d))
+		r = 1;
+	return (r);
+}
+
+static int
+put_sample(struct data *d, unsigned since, unsigned ts,
+    unsigned unit, double val, int flags)
+{
+	struct sample *s, t;
+
+	if (d->shard != NULL)
+		return ((d = shard_get(d, shard_of(d, unit))) == NULL ? 1 :
+		    put_sample(d, since, ts, unit, val, flags));
+	if (unit_check(d, unit))
+		return (1);
+	if (d->jfd == -1 && !d->batching)
+		return (put_value(d, since, ts, unit, val, flags));
+	memset(&t, 0, sizeof(t));
+	t.since = since;
+	t.ts = ts;
+	t.unit = unit;
+	t.flags = flags;
+	t.val = val;
+	if (d->jfd != -1)
+		return (journal_put(d, &t));
+	if (d->nbatch == d->maxbatch) {
+		unsigned n = d->maxbatch ? 2 * d->maxbatch : 64;
+
+		if ((s = reallocarray(d->batch, n, sizeof(*s))) == NULL) {
+			fprintf(stderr, "data_put_value: reallocarray: %s\n",
+			    strerror(errno));
+			return (1);
+		}
+		d->batch = s;
+		d->maxbatch = n;
+	}
+	t.seq = d->nbatch;
+	d->batch[d->nbatch++] = t;
+	return (0);
+}
+
+int
+data_put_value(struct data *d, unsigned since, unsigned ts,
+    unsigned unit, double val, int flags)
+{
+	if (put_sample(d, since, ts, unit, val, flags))
+		return (1);
+	return (d->chfd != -1 ?
+	    change_add(d, since, ts, unit, val, flags) : 0);
+}
+
+int
+data_batch_begin(struct data *d)
+{
+	unsigned i;
+
+	if (d->batching) {
+		fprintf(stderr, "data_batch_begin: batch already open\n");
+		return (1);
+	}
+	if (d->shard != NULL)
+		for (i = 0; i < d->conf.shards; ++i)
+			if (d->shard[i] != NULL &&
+			    data_batch_begin(d->shard[i]))
+				return (1);
+	d->batching = 1;
+	d->nbatch = 0;
+	return (0);
+}
+
+/* sync according to the durability policy */
+static int
+batch_sync(struct data *d)
+{
+	time_t now = time(NULL);
+
+	if (d->sync == DATA_SYNC_NEVER ||
+	    (d->sync > 0 && now - d->synced < d->sync))
+		return (0);
+	if (d->jfd != -1 ? fsync(d->jfd) : d->db->sync(d->db, 0)) {
+		fprintf(stderr, "sync: %s: %s\n", d->jfd != -1 ? d->jfn :
+		    d->fn, strerror(errno));
+		return (1);
+	}
+	if (d->jfd == -1 && last_sync(&d->lt))
+		return (1);
+	d->synced = now;
+	return (0);
+}
+
+/*
+ * Apply the queued values in key order, so every page is visited
+ * once, then sync.  With a journal, the values are already written
+ * to it, and are applied when the flush interval has passed.
+ */
+int
+data_batch_commit(struct data *d)
+{
+	unsigned i;
+	int r = 0;
+
+	if (!d->batching)
+		return (0);
+	d->batching = 0;
+	/* logged ahead of the database, like the journal */
+	if (change_flush(d))
+		r = 1;
+	if (d->shard != NULL) {
+		for (i = 0; i < d->conf.shards; ++i)
+			if (d->shard[i] != NULL &&
+			    data_batch_commit(d->shard[i]))
+				r = 1;
+		return (r);
+	}
+	if (d->jfd != -1) {
+		if (batch_sync(d))
+			return (1);
+		if (d->nmem >= MAX_MEM ||
+		    time(NULL) - d->flushed >= d->flush)
+			return (journal_flush(d));
+		return (0);
+	}
+	qsort(d->batch, d->nbatch, sizeof(*d->batch), sample_cmp);
+	for (i = 0; i < d->nbatch; ++i) {
+		struct sample *s = &d->batch[i];
+
+		if (put_value(d, s->since, s->ts, s->unit, s->val, s->flags))
+			r = 1;
+	}
+	if (debug > 0)
+		printf("data_batch_commit: %u values\n", d->nbatch);
+	d->nbatch = 0;
+	if (batch_sync(d))
+		r = 1;
+	return (r);
+}
+
+void
+data_sync_policy(struct data *d, int sync)
+{
+	unsigned i;
+
+	d->sync = sync;
+	if (d->shard != NULL)
+		for (i = 0; i < d->conf.shards; ++i)
+			if (d->shard[i] != NULL)
+				data_sync_policy(d->shard[i], sync);
+}
+
+/* find highest level of unit with more than siz entries within beg-end */
+static int
+get_values_find_level(struct data *d, unsigned unit, unsigned beg,
+    unsigned end, unsigned siz)
+{
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	short level = 0;
+
+	/* find highest level at all */
+	level = find_highest_level(d, unit);
+	if (debug > 0)
+		printf("get_values_find_level: highest level overall is %d\n",
+		    (int)level);
+	while (level > 0) {
+		unsigned count = 0;
 		int r;
 
 		if (debug > 0)
-			printf("get_values_find_level: trying level %d\n",
-			    (int)level);
+			printf("get_values_find_level: trying level %d\n",
+			    (int)level);
+
+		k.unit = unit;
+		k.level = level;
+		k.ts = beg;
+		key_pack(d->format, &k, kb, &dbk);
+
+		for (r = dbseq(d, &dbk, &dbd, R_CURSOR); !r;
+		    r = dbseq(d, &dbk, &dbd, R_NEXT)) {
+			if (key_unpack(d->format, &dbk, &k))
+				break;
+			if (k.unit != unit || k.level != level || k.ts > end)
+				break;
+			++count;
+		}
+		if (debug > 0)
+			printf("get_values_find_level: found %u entries "
+			    "for level %d\n", count, (int)level);
+		if (siz + 32 <= count) {
+			if (debug > 0)
+				printf("get_values_find_level: siz %u + 32 "
+				    "<= count %u, using level %d\n",
+				    siz, count, (int)level);
+			break;
+		}
+		--level;
+	}
+	if (debug > 0)
+		printf("get_values_find_level(unit %d, beg %u, end %u, siz %u) "
+		    "returning level %d\n", (int)unit, beg, end, siz, level);
+	return (level);
+}
+
+/*
+ * Add value v, holding from sa to sb (seconds since beg), to the pixels
+ * it covers.  Only the first and last pixel can be covered partially,
+ * the ones in between are updated by a plain loop over the array.  For
+ * averages, w sums up the part of each pixel covered.  Gap markers
+ * cover nothing.
+ */
+static inline void
+get_values_resample(int type, unsigned siz, double *a, double *w,
+    double spp, double sa, double sb, double v)
+{
+	unsigned i, j, x;
+	double f[2];
+
+	if (debug > 2)
+		printf("get_values_resample(type %d, siz %u, spp %.2f, "
+		    "sa %.2f, sb %.2f, v %.2f)\n", type, siz, spp, sa, sb, v);
+	if (sb <= sa || isnan(v))
+		return;
+	i = sa / spp;
+	j = sb / spp;
+	if (j >= siz)
+		j = siz - 1;
+	if (i > j)
+		return;
+	if (i == j) {
+		f[0] = sb - sa;
+		f[1] = 0.0;
+	} else {
+		f[0] = (double)(i + 1) * spp - sa;
+		f[1] = sb - (double)j * spp;
+	}
+	switch (type) {
+	case DATA_TYPE_AVG:
+		a[i] += v * (f[0] / spp);
+		w[i] += f[0] / spp;
+		for (x = i + 1; x < j; ++x) {
+			a[x] += v;
+			w[x] += 1.0;
+		}
+		if (i < j && f[1] > 0.0) {
+			a[j] += v * (f[1] / spp);
+			w[j] += f[1] / spp;
+		}
+		break;
+	case DATA_TYPE_MAX:
+		if (i < j && f[1] <= 0.0)
+			--j;
+		for (x = i; x <= j; ++x)
+			a[x] = a[x] < v ? v : a[x];
+		break;
+	case DATA_TYPE_MIN:
+		if (i < j && f[1] <= 0.0)
+			--j;
+		for (x = i; x <= j; ++x)
+			a[x] = a[x] > v ? v : a[x];
+		break;
+	}
+}
+
+/*
+ * Resample pixels from-siz of the window starting at beg, spp seconds
+ * per pixel.  The pixels before from are left alone, a value holding
+ * across the first recomputed pixel is taken from the record before it.
+ * Pixels no value covers are set to NaN.  Returns the timestamp of the
+ * last record used in *last.
+ */
+static int
+get_values_range(struct data *d, unsigned unit, int level, int type,
+    double beg, double spp, unsigned siz, double *a, unsigned from,
+    unsigned *last)
+{
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	struct val v;
+	double pb = beg + (double)from * spp, end = beg + (double)siz * spp;
+	double x, xp = 0.0, *mv = NULL, *w = NULL;
+	unsigned i, j = 0, nm = 0, ts, tp = 0, *mt = NULL;
+	int r;
+
+	if (type == DATA_TYPE_AVG &&
+	    (w = calloc(siz, sizeof(*w))) == NULL) {
+		fprintf(stderr, "get_values: calloc: %s\n", strerror(errno));
+		return (1);
+	}
+	for (i = from; i < siz; ++i)
+		a[i] = type == DATA_TYPE_AVG ? 0.0 :
+		    (type == DATA_TYPE_MAX ? -DBL_MAX : DBL_MAX);
+	ts = ceil(pb);
+	if (from > 0 && (i = find_prev_ts(d, unit, level, (unsigned)pb)) &&
+	    (double)i >= beg)
+		ts = i;
+	/* recent values still in the journal, merged with the records */
+	if (level == 0 && d->nmem) {
+		if (mem_values(d, unit, &mt, &mv, &nm)) {
+			free(w);
+			return (1);
+		}
+		while (j < nm && mt[j] < ts)
+			j++;
+		/* the value holding at pb may be in the journal, too */
+		if (from > 0 && j > 0 && (double)mt[j - 1] >= beg)
+			j--;
+	}
+
+	if (debug > 1)
+		printf("get_values: seeking for %d, %d, %u\n", (int)unit,
+		    level, ts);
+
+	k.unit = unit;
+	k.level = level;
+	k.ts = ts;
+	key_pack(d->format, &k, kb, &dbk);
+
+	/*
+	 * Walk the records forward in a single pass, each value holds
+	 * until the next record, the last one until the end of the range.
+	 */
+	for (r = dbseq(d, &dbk, &dbd, R_CURSOR); ;
+	    r = dbseq(d, &dbk, &dbd, R_NEXT)) {
+		if (r || key_unpack(d->format, &dbk, &k))
+			k.ts = MAX_TS;
+		else {
+			if (debug > 1)
+				printf("get_values: got %d, %d, %u\n",
+				    (int)k.unit, (int)k.level, k.ts);
+			if (k.unit != unit || k.level != level ||
+			    get_val(&dbd, level, &v))
+				k.ts = MAX_TS;
+		}
+		for (; j < nm && mt[j] < k.ts && mt[j] <= end; ++j) {
+			if (tp)
+				get_values_resample(type, siz, a, w, spp,
+				    (tp < pb ? pb : tp) - beg, mt[j] - beg, xp);
+			tp = mt[j];
+			xp = mv[j];
+		}
+		if (k.ts > end) {
+			if (debug > 0)
+				printf("get_values: end of sequence\n");
+			break;
+		}
+		if (type == DATA_TYPE_MIN)
+			x = v.min;
+		else if (type == DATA_TYPE_AVG)
+			x = v.avg;
+		else
+			x = v.max;
+
+		if (debug > 1)
+			printf("get_values: tp %u, ts %u, diff %u, v %.2f\n",
+			    tp, k.ts, k.ts - tp, xp);
+		if (tp)
+			get_values_resample(type, siz, a, w, spp,
+			    (tp < pb ? pb : tp) - beg, k.ts - beg, xp);
+		tp = k.ts;
+		xp = x;
+	}
+	if (tp)
+		get_values_resample(type, siz, a, w, spp,
+		    (tp < pb ? pb : tp) - beg, end - beg, xp);
+	for (i = from; i < siz; ++i)
+		if (type == DATA_TYPE_AVG)
+			a[i] = w[i] > 0.0 ? a[i] / w[i] : NAN;
+		else if (a[i] <= -DBL_MAX || a[i] >= DBL_MAX)
+			a[i] = NAN;
+	*last = tp;
+	free(w);
+	free(mt);
+	free(mv);
+	return (0);
+}
+
+/*
+ * Resample through the cache.  The window is aligned to whole pixels
+ * since the epoch, so a window moved forward reuses the cached pixels
+ * shifted, and only the pixels from the last record used before on
+ * are computed again, unless values were filled in or rebuilt since.
+ */
+static int
+get_values_cached(struct data *d, unsigned unit, int level, int type,
+    unsigned beg, unsigned end, unsigned siz, double *a)
+{
+	struct ckey ck;
+	struct chdr ch;
+	DBT ckt, cdt;
+	double spp = (double)(end - beg) / (double)siz, e, *p = NULL;
+	unsigned from = 0, n, last, gen;
+	int r;
+
+	if (gen_get(d, &gen))
+		return (1);
+	e = floor((double)end / spp);
+	memset(&ck, 0, sizeof(ck));
+	ck.unit = htonl(unit);
+	ck.level = htons(level);
+	ck.type = htons(type);
+	ck.siz = htonl(siz);
+	ck.span = htonl(end - beg);
+	memset(&ckt, 0, sizeof(ckt));
+	ckt.size = sizeof(ck);
+	ckt.data = &ck;
+	memset(&cdt, 0, sizeof(cdt));
+	r = d->cdb->get(d->cdb, &ckt, &cdt, 0);
+	if (r < 0)
+		fprintf(stderr, "get_values: cache get: %s\n",
+		    strerror(errno));
+	if (!r && cdt.size == sizeof(ch) + siz * sizeof(double)) {
+		memcpy(&ch, cdt.data, sizeof(ch));
+		p = (double *)((char *)cdt.data + sizeof(ch));
+	}
+	/* before format 3, values filled in would not be seen */
+	if (p != NULL && ch.end <= e && e - ch.end < siz && ch.last &&
+	    ch.gen == gen && d->format >= 3) {
+		n = e - ch.end;
+		memmove(a, p + n, (siz - n) * sizeof(double));
+		if (ch.last > (e - siz) * spp)
+			from = ((double)ch.last / spp) - (e - siz);
+		if (from > siz - n)
+			from = siz - n;
+		if (debug > 0)
+			printf("get_values: cache hit, shift %u, from %u\n",
+			    n, from);
+	}
+	if (get_values_range(d, unit, level, type, (e - siz) * spp, spp, siz,
+	    a, from, &last))
+		return (1);
+	if (from && !last)
+		last = ch.last;
+
+	memset(&ch, 0, sizeof(ch));
+	ch.end = e;
+	ch.last = last;
+	ch.gen = gen;
+	if ((p = malloc(sizeof(ch) + siz * sizeof(double))) == NULL) {
+		fprintf(stderr, "get_values: malloc: %s\n", strerror(errno));
+		return (1);
+	}
+	memcpy(p, &ch, sizeof(ch));
+	memcpy((char *)p + sizeof(ch), a, siz * sizeof(double));
+	cdt.size = sizeof(ch) + siz * sizeof(double);
+	cdt.data = p;
+	if (d->cdb->put(d->cdb, &ckt, &cdt, 0))
+		fprintf(stderr, "get_values: cache put: %s\n",
+		    strerror(errno));
+	free(p);
+	return (0);
+}
+
+struct quantile {
+	struct sketch	 px;	/* records of the current pixel */
+	struct sketch	 last;	/* last record, holding until the next */
+	double		 q;
+	unsigned	 cp;
+	int		 have;
+};
+
+/* move on to pixel p, completing the pixels before it */
+static void
+quantile_pixel(struct quantile *qs, double *a, unsigned p)
+{
+	unsigned i;
+
+	if (qs->have && p != qs->cp) {
+		if (qs->px.n)
+			a[qs->cp] = sketch_quantile(&qs->px, qs->q);
+		for (i = qs->cp + 1; i < p && qs->last.n; ++i)
+			a[i] = sketch_quantile(&qs->last, qs->q);
+		sketch_reset(&qs->px);
+	}
+	qs->cp = p;
+	qs->have = 1;
+	sketch_reset(&qs->last);
+}
+
+/*
+ * Percentiles per pixel, from the merged sketches of the records within
+ * each pixel, level 0 values counting once.  Pixels without records
+ * take the percentile of the last record before them, unless it is a
+ * gap marker, which adds nothing to the sketches.
+ */
+static int
+get_values_quantile(struct data *d, unsigned unit, int level, double q,
+    unsigned beg, unsigned end, unsigned siz, double *a)
+{
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	struct val v;
+	struct quantile qs;
+	double spp = (double)(end - beg) / (double)siz, *mv = NULL;
+	unsigned i, j = 0, nm = 0, *mt = NULL;
+	int r, e = 0;
+
+	for (i = 0; i < siz; ++i)
+		a[i] = NAN;
+	if (level == 0 && d->nmem && mem_values(d, unit, &mt, &mv, &nm))
+		return (1);
+	memset(&qs, 0, sizeof(qs));
+	sketch_init(&qs.px);
+	sketch_init(&qs.last);
+	qs.q = q;
+
+	k.unit = unit;
+	k.level = level;
+	k.ts = beg;
+	key_pack(d->format, &k, kb, &dbk);
+	for (r = dbseq(d, &dbk, &dbd, R_CURSOR); !e;
+	    r = dbseq(d, &dbk, &dbd, R_NEXT)) {
+		if (r || key_unpack(d->format, &dbk, &k))
+			k.ts = MAX_TS;
+		else {
+			if (k.unit != unit || k.level != level ||
+			    get_val(&dbd, level, &v))
+				k.ts = MAX_TS;
+		}
+		for (; j < nm && mt[j] < k.ts && mt[j] < end && !e; ++j) {
+			if (mt[j] < beg)
+				continue;
+			quantile_pixel(&qs, a, (mt[j] - beg) / spp);
+			e = sketch_add(&qs.px, mv[j], 1) ||
+			    sketch_add(&qs.last, mv[j], 1);
+		}
+		if (k.ts >= end)
+			break;
+		quantile_pixel(&qs, a, (k.ts - beg) / spp);
+		e = sketch_record(&qs.px, &dbd, &v) ||
+		    sketch_record(&qs.last, &dbd, &v);
+	}
+	if (qs.have)
+		quantile_pixel(&qs, a, siz);
+	sketch_free(&qs.px);
+	sketch_free(&qs.last);
+	free(mt);
+	free(mv);
+	return (e);
+}
+
+int
+data_get_values(struct data *d, unsigned unit, unsigned beg,
+    unsigned end, int type, unsigned siz, double *a, int console)
+{
+	double m;
+	unsigned i, last;
+	unsigned long ops = d->ops;
+	long blocks = inblock();
+	int level;
+
+	if (d->shard != NULL)
+		return ((d = shard_get(d, shard_of(d, unit))) == NULL ? 1 :
+		    data_get_values(d, unit, beg, end, type, siz, a, console));
+	if (unit_check(d, unit))
+		return (1);
+	if (beg >= end) {
+		fprintf(stderr, "get_values: beg %u >= end %u\n", beg, end);
+		return (1);
+	}
+	if (type != DATA_TYPE_MIN && type != DATA_TYPE_AVG &&
+	    type != DATA_TYPE_MAX && !DATA_TYPE_IS_PERCENTILE(type)) {
+		fprintf(stderr, "get_values: invalid type %d\n", type);
+		return (1);
+	}
+	level = get_values_find_level(d, unit, beg, end, siz);
+	if (level < 0)
+		return (1);
+	if (DATA_TYPE_IS_PERCENTILE(type)) {
+		if (get_values_quantile(d, unit, level, (type - 100) / 100.0,
+		    beg, end, siz, a))
+			return (1);
+	} else if (d->cdb != NULL && !console) {
+		if (get_values_cached(d, unit, level, type, beg, end, siz, a))
+			return (1);
+	} else if (get_values_range(d, unit, level, type, beg,
+	    (double)(end - beg) / (double)siz, siz, a, 0, &last))
+		return (1);
+	if (debug > 0)
+		print_stats("get_values", d->ops - ops, inblock() - blocks);
+
+	if (debug) {
+		m = -DBL_MAX;
+		for (i = 0; i < siz; ++i)
+			if (a[i] > m)
+				m = a[i];
+		if (debug > 0)
+			printf("get_values: maximum (%u values) %.2f\n",
+			    siz, m);
+	}
+	if (console) {
+		double carray[siz];
+		double cprev = DBL_MAX, ptop = -DBL_MAX, ctop = -DBL_MAX;
+		double psum = 0, csum = 0;
+		int pregister = 0, cshow = 0;
+
+		// get max value
+		for (i = 0; i < siz; ++i)
+			if (a[i] > ptop)
+				ptop = a[i];
+
+		for(i = 0; i < siz; ++i)
+			carray[i] = 0; // set all to 0
+		for(i = 0; i < siz; ++i) {
+			if (debug) {
+				printf("%.2f ", a[i]); // print all values
+			}
+			if (!isnan(a[i]) && a[i] != 0 && a[i] != cprev) {
+				// add if prevous value is different
+				carray[i] = a[i];
+				// increase values counter
+				pregister += 1;
+			}
+			// safe previous value for next iteration
+			cprev = a[i];
+		}
+		if (debug)
+			printf("\n");
+
+		// save values counter for next cycle
+		level = pregister;
+		pregister = 0;
+		// if less than 16 values print them
+		if (level < 16)
+			cshow = 1;
+		printf("queue: ");
+		for(i = 0; i < siz; ++i) {
+			if (carray[i] == 0)
+				continue;
+			if (debug) {
+				// print all values in debug mode
+				printf("%.2f ", carray[i]);
+			}
+			psum += carray[i];
+			pregister += 1;
+			// print last 16 values
+			if ((level - pregister) == 15)
+				cshow = 1;
+			if (cshow) {
+				printf("%.2f ", carray[i]);
+				if (carray[i] > ctop) {
+					// save current top, last 16
+					ctop = carray[i];
+				}
+				csum += carray[i];
+				cshow++; // increase to calculate 'csum'
+			}
+		}
+		if (pregister) {
+			printf("\n");
+			// period
+			printf("pavg: %.2f, pmax: %.2f\n", psum/pregister, ptop);
+			// current
+			printf("cavg: %.2f, cmax: %.2f\n", csum/cshow, ctop);
+		} else {
+			printf("0\n");
+			// period
+			printf("pavg: 0.00, pmax: 0.00\n");
+			// current
+			printf("cavg: 0.00, cmax: 0.00\n");
+		}
+	}
+	return (0);
+}
+
+/* add the summary of a value record to s */
+static void
+summary_val(struct data_summary *s, const struct val *v)
+{
+	if (isnan(v->avg) || v->count <= 0.0)
+		return;
+	if (v->min < s->min)
+		s->min = v->min;
+	if (v->max > s->max)
+		s->max = v->max;
+	s->count += v->count;
+	s->sum += v->sum;
+	s->sumsq += v->sumsq;
+}
+
+/* add the level 0 values of unit within beg-end, journal included */
+static int
+summary_values(struct data *d, unsigned unit, unsigned beg,
+    unsigned end, struct data_summary *s)
+{
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	struct val v;
+	double *mv = NULL;
+	unsigned i, nm = 0, *mt = NULL;
+	int r;
+
+	k.unit = unit;
+	k.level = 0;
+	k.ts = beg;
+	key_pack(d->format, &k, kb, &dbk);
+	for (r = dbseq(d, &dbk, &dbd, R_CURSOR); !r;
+	    r = dbseq(d, &dbk, &dbd, R_NEXT)) {
+		if (key_unpack(d->format, &dbk, &k) || k.unit != unit ||
+		    k.level != 0 || k.ts >= end || get_val(&dbd, 0, &v))
+			break;
+		summary_val(s, &v);
+	}
+	if (!d->nmem)
+		return (0);
+	if (mem_values(d, unit, &mt, &mv, &nm))
+		return (1);
+	for (i = 0; i < nm; ++i)
+		if (mt[i] >= beg && mt[i] < end && !isnan(mv[i])) {
+			v.min = v.avg = v.max = v.sum = mv[i];
+			v.count = 1.0;
+			v.sumsq = mv[i] * mv[i];
+			summary_val(s, &v);
+		}
+	free(mt);
+	free(mv);
+	return (0);
+}
+
+/*
+ * Add the values of unit within beg-end to s, taking the buckets of
+ * level which lie within the range whole, and the parts at the edges
+ * and the buckets not rolled up (yet) from the levels below.  Each
+ * level reads at most a few records at either edge.
+ */
+static int
+summary_level(struct data *d, unsigned unit, int level, unsigned beg,
+    unsigned end, struct data_summary *s)
+{
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	struct val v;
+	unsigned w, b, e, next, ts;
+	int r;
+
+	if (beg >= end)
+		return (0);
+	if (level == 0)
+		return (summary_values(d, unit, beg, end, s));
+	w = level_width[level];
+	b = beg % w ? beg - beg % w + w : beg;
+	e = end - end % w;
+	if (b < beg || b >= e)
+		return (summary_level(d, unit, level - 1, beg, end, s));
+	if (summary_level(d, unit, level - 1, beg, b, s))
+		return (1);
+	for (next = b; next < e; next = ts) {
+		k.unit = unit;
+		k.level = level;
+		k.ts = next;
+		key_pack(d->format, &k, kb, &dbk);
+		for (r = dbseq(d, &dbk, &dbd, R_CURSOR); ;
+		    r = dbseq(d, &dbk, &dbd, R_NEXT)) {
+			ts = e;
+			if (r || key_unpack(d->format, &dbk, &k) ||
+			    k.unit != unit || k.level != level)
+				break;
+			ts = k.ts;
+			if (ts >= e) {
+				ts = e;
+				break;
+			}
+			/* a record off the bucket grid is left to below */
+			if (ts != next || get_val(&dbd, level, &v)) {
+				ts = ts - ts % w + w;
+				break;
+			}
+			summary_val(s, &v);
+			next += w;
+		}
+		if (ts > e)
+			ts = e;
+		/* the buckets missing before ts */
+		if (summary_level(d, unit, level - 1, next, ts, s))
+			return (1);
+	}
+	return (summary_level(d, unit, level - 1, e, end, s));
+}
+
+/*
+ * Minimum, maximum, count, sum and squares of the values of unit within
+ * beg-end, and their average.  Gap markers are not counted.
+ */
+int
+data_get_summary(struct data *d, unsigned unit, unsigned beg,
+    unsigned end, struct data_summary *s)
+{
+	unsigned long ops = d->ops;
+	long blocks = inblock();
+	int level;
+
+	if (d->shard != NULL)
+		return ((d = shard_get(d, shard_of(d, unit))) == NULL ? 1 :
+		    data_get_summary(d, unit, beg, end, s));
+	memset(s, 0, sizeof(*s));
+	if (unit_check(d, unit))
+		return (1);
+	if (beg >= end) {
+		fprintf(stderr, "get_summary: beg %u >= end %u\n", beg, end);
+		return (1);
+	}
+	s->min = DBL_MAX;
+	s->max = -DBL_MAX;
+	level = find_highest_level(d, unit);
+	if (level >= NLEVELS)
+		level = NLEVELS - 1;
+	/* values stored at end, "now" for -g, are included */
+	if (summary_level(d, unit, level, beg, end < MAX_TS ? end + 1 : end,
+	    s))
+		return (1);
+	if (s->count > 0.0)
+		s->avg = s->sum / s->count;
+	else
+		s->min = s->max = 0.0;
+	if (debug > 0) {
+		printf("get_summary(unit %d, beg %u, end %u) count %.0f\n",
+		    (int)unit, beg, end, s->count);
+		print_stats("get_summary", d->ops - ops, inblock() - blocks);
+	}
+	return (0);
+}
+
+/* page size of an existing database, from its meta page */
+static unsigned
+data_psize(const char *filename)
+{
+	u_int32_t m[3];
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		return (0);
+	if (read(fd, m, sizeof(m)) != sizeof(m)) {
+		close(fd);
+		return (0);
+	}
+	close(fd);
+	if (m[0] == BTREEMAGIC)
+		return (m[2]);
+	if (SWAP32(m[0]) == BTREEMAGIC)
+		return (SWAP32(m[2]));
+	return (0);
+}
+
+/*
+ * Size pages and cache for the number of units in use.  Storing a value
+ * touches the last leaf page of every level of a unit, and all lookups
+ * go through the internal pages, so keep those resident.  The page size
+ * only applies to a newly created database.
+ */
+static void
+data_tune(struct data *d, unsigned units, unsigned psize,
+    unsigned cachesize)
+{
+	struct stat st;
+	unsigned long pages = 0, internal = 0, fanout, size;
+
+	if (!psize)
+		psize = units > 1024 ? 16384 : (units > 64 ? 8192 : 4096);
+	if (data_psize(d->fn))
+		psize = data_psize(d->fn);
+	if (!cachesize) {
+		if (stat(d->fn, &st) == 0)
+			pages = st.st_size / psize;
+		/* an internal entry holds a key and a page number */
+		fanout = psize / (KEY_SIZE_3 + 8);
+		while (pages > 1) {
+			pages = (pages + fanout - 1) / fanout;
+			internal += pages;
+		}
+		size = ((unsigned long)units * (NLEVELS + 1) + internal) *
+		    psize;
+		if (size < 64 * psize)
+			size = 64 * psize;
+		if (size > 256 * 1024 * 1024)
+			size = 256 * 1024 * 1024;
+		cachesize = size;
+	}
+	memset(&d->btreeinfo, 0, sizeof(d->btreeinfo));
+	d->btreeinfo.psize = psize;
+	d->btreeinfo.cachesize = cachesize;
+	if (debug > 0)
+		printf("data_open: %s: %u units, page size %u, cache size %u\n",
+		    d->fn, units, psize, cachesize);
+}
+
+/* mark a database as of the current format */
+static int
+put_format(DB *db)
+{
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	struct meta m;
+
+	k.unit = 0;
+	k.level = MAX_LEVEL;
+	k.ts = MAX_TS;
+	key_pack(DATA_FORMAT, &k, kb, &dbk);
+	m.format = htonl(DATA_FORMAT);
+	memset(&dbd, 0, sizeof(dbd));
+	dbd.size = sizeof(m);
+	dbd.data = &m;
+	return (db->put(db, &dbk, &dbd, 0));
+}
+
+/*
+ * Find the format of the database.  A new database gets the current
+ * one, one without a format record is of format 1 until it is copied
+ * or compacted.  The format record has the key size of its format.
+ */
+static int
+data_format(struct data *d)
+{
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	struct meta m;
+	int r;
+
+	k.unit = 0;
+	k.level = MAX_LEVEL;
+	k.ts = MAX_TS;
+	key_pack(3, &k, kb, &dbk);
+	r = dbget(d, &dbk, &dbd, 0);
+	if (r == 1) {
+		key_pack(2, &k, kb, &dbk);
+		r = dbget(d, &dbk, &dbd, 0);
+	}
+	if (r < 0) {
+		fprintf(stderr, "data_open: %s: db->get: %s\n", d->fn,
+		    strerror(errno));
+		return (1);
+	}
+	if (!r && dbd.size == sizeof(m) && dbd.data) {
+		memcpy(&m, dbd.data, sizeof(m));
+		d->format = ntohl(m.format);
+		if (d->format > DATA_FORMAT) {
+			fprintf(stderr, "data_open: %s: unsupported format "
+			    "%u\n", d->fn, d->format);
+			return (1);
+		}
+		return (0);
+	}
+	d->format = 1;
+	if (d->rdonly || dbseq(d, &dbk, &dbd, R_FIRST) != 1)
+		return (0);
+	d->format = DATA_FORMAT;
+	if (put_format(d->db)) {
+		fprintf(stderr, "data_open: %s: db->put: %s\n", d->fn,
+		    strerror(errno));
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Find whether the database keeps the snapshot index, and start it
+ * with conf.snapshot.  Once started, every writer keeps it.
+ */
+static int
+snap_check(struct data *d)
+{
+	u_int8_t kb[4] = { 0xff, 0xff, 0xff, 0xfe };
+	u_int32_t w = htonl(level_width[0]);
+	DBT dbk, dbd;
+	int r;
+
+	d->snap = 0;
+	if (d->format < 3)
+		return (0);
+	memset(&dbk, 0, sizeof(dbk));
+	dbk.size = sizeof(kb);
+	dbk.data = kb;
+	if ((r = dbget(d, &dbk, &dbd, 0)) == 1 && d->conf.snapshot &&
+	    !d->rdonly) {
+		memset(&dbd, 0, sizeof(dbd));
+		dbd.size = sizeof(w);
+		dbd.data = &w;
+		r = dbput(d, &dbk, &dbd, 0);
+	}
+	if (r < 0) {
+		fprintf(stderr, "data_open: %s: snapshot index: %s\n", d->fn,
+		    strerror(errno));
+		return (1);
+	}
+	d->snap = r == 0;
+	return (0);
+}
+
+/* open and lock the database */
+static int
+data_attach(struct data *d)
+{
+	struct stat st, sn;
+
+	for (;;) {
+		data_tune(d, d->conf.units, d->conf.psize, d->conf.cachesize);
+		d->db = dbopen(d->fn, d->rdonly ? O_RDONLY|O_SHLOCK :
+		    O_CREAT|O_EXLOCK|O_RDWR, 0600, DB_BTREE, &d->btreeinfo);
+		if (d->db == NULL) {
+			fprintf(stderr, "dbopen: %s: %s\n", d->fn,
+			    strerror(errno));
+			return (1);
+		}
+		/* replaced by data_compact() while waiting for the lock */
+		if (fstat(d->db->fd(d->db), &st) || stat(d->fn, &sn) ||
+		    (st.st_dev == sn.st_dev && st.st_ino == sn.st_ino))
+			break;
+		if (debug > 0)
+			printf("data_open: %s replaced, reopening\n", d->fn);
+		d->db->close(d->db);
+	}
+	if (data_format(d) || snap_check(d) ||
+	    (!d->rdonly && compact_log_open(d))) {
+		data_detach(d);
+		return (1);
+	}
+	return (0);
+}
+
+/* close the database, db(3) syncs on close regardless of the policy */
+static int
+data_detach(struct data *d)
+{
+	int r = 0;
+
+	if (d->kfd != -1) {
+		if (compact_log_flush(d))
+			r = 1;
+		close(d->kfd);
+		d->kfd = -1;
+	}
+	if (d->db->close(d->db)) {
+		fprintf(stderr, "dbclose: %s: %s\n", d->fn, strerror(errno));
+		r = 1;
+	}
+	d->db = NULL;
+	return (r);
+}
+
+static unsigned
+shard_of(struct data *d, unsigned unit)
+{
+	if (!d->conf.range)
+		return (unit % d->conf.shards);
+	if (unit / d->conf.range >= d->conf.shards)
+		return (d->conf.shards - 1);
+	return (unit / d->conf.range);
+}
+
+/* open and lock a shard on first use, with the settings of the set */
+static struct data *
+shard_get(struct data *d, unsigned i)
+{
+	struct data_conf conf;
+	struct data *s;
+
+	if (d->shard[i] != NULL)
+		return (d->shard[i]);
+	conf = d->conf;
+	conf.units = d->conf.units / d->conf.shards + 1;
+	conf.shards = 0;
+	conf.changes = 0;
+	if ((s = data_open(d->shardfn[i], d->rdonly, &conf)) == NULL)
+		return (NULL);
+	data_sync_policy(s, d->sync);
+	s->cfn = d->cfn;
+	s->cdb = d->cdb;
+	d->shard[i] = s;
+	if ((d->flush && data_journal_open(s, d->flush)) ||
+	    (d->batching && data_batch_begin(s))) {
+		shard_close(d, i);
+		return (NULL);
+	}
+	return (s);
+}
+
+static int
+shard_close(struct data *d, unsigned i)
+{
+	struct data *s = d->shard[i];
+
+	if (s == NULL)
+		return (0);
+	/* the cache is shared by all shards */
+	s->cdb = NULL;
+	d->shard[i] = NULL;
+	return (data_close(s));
+}
+
+static struct data *
+data_open_shards(struct data *d)
+{
+	unsigned i;
+	size_t len;
+
+	d->shard = calloc(d->conf.shards, sizeof(*d->shard));
+	d->shardfn = calloc(d->conf.shards, sizeof(*d->shardfn));
+	if (d->shard == NULL || d->shardfn == NULL)
+		goto fail;
+	len = strlen(d->fn) + 12;
+	for (i = 0; i < d->conf.shards; ++i) {
+		if ((d->shardfn[i] = malloc(len)) == NULL)
+			goto fail;
+		snprintf(d->shardfn[i], len, "%s.%u", d->fn, i);
+	}
+	return (d);
+
+fail:
+	fprintf(stderr, "data_open: calloc: %s\n", strerror(errno));
+	data_close(d);
+	return (NULL);
+}
+
+struct data *
+data_open(const char *filename, int rdonly, const struct data_conf *conf)
+{
+	struct data *d;
+	size_t len;
+
+	if ((d = calloc(1, sizeof(*d))) == NULL) {
+		fprintf(stderr, "data_open: calloc: %s\n", strerror(errno));
+		return (NULL);
+	}
+	d->fn = filename;
+	d->inblock = inblock();
+	d->synced = time(NULL);
+	d->rdonly = rdonly;
+	d->conf = *conf;
+	d->jfd = -1;
+	d->kfd = -1;
+	RB_INIT(&d->mem);
+	if (change_open(d)) {
+		change_close(d);
+		free(d);
+		return (NULL);
+	}
+	/* a set of files, each opened when a unit in it is used */
+	if (d->conf.shards > 1)
+		return (data_open_shards(d));
+	len = strlen(filename) + sizeof(".journal");
+	if ((d->jfn = malloc(len)) == NULL) {
+		fprintf(stderr, "data_open: malloc: %s\n", strerror(errno));
+		change_close(d);
+		free(d);
+		return (NULL);
+	}
+	snprintf(d->jfn, len, "%s.journal", filename);
+	len = strlen(filename) + sizeof(".compact.keys");
+	if ((d->kfn = malloc(len)) == NULL) {
+		fprintf(stderr, "data_open: malloc: %s\n", strerror(errno));
+		change_close(d);
+		free(d->jfn);
+		free(d);
+		return (NULL);
+	}
+	snprintf(d->kfn, len, "%s.compact.keys", filename);
+	if (data_attach(d)) {
+		change_close(d);
+		free(d->jfn);
+		free(d->kfn);
+		free(d);
+		return (NULL);
+	}
+	if (last_open(&d->lt, filename, rdonly)) {
+		data_close(d);
+		return (NULL);
+	}
+	/* values not yet flushed by a writer with a journal */
+	if (journal_load(d)) {
+		fprintf(stderr, "data_open: %s: %s\n", d->jfn,
+		    strerror(errno));
+		data_close(d);
+		return (NULL);
+	}
+	return (d);
+}
+
+int
+data_close(struct data *d)
+{
+	unsigned i;
+
+	if (d->shard != NULL || d->shardfn != NULL) {
+		for (i = 0; d->shard != NULL && i < d->conf.shards; ++i)
+			shard_close(d, i);
+		for (i = 0; d->shardfn != NULL && i < d->conf.shards; ++i)
+			free(d->shardfn[i]);
+		data_cache_close(d);
+		change_close(d);
+		free(d->shard);
+		free(d->shardfn);
+		free(d);
+		return (0);
+	}
+	data_cache_close(d);
+	if (data_batch_commit(d))
+		fprintf(stderr, "data_close: data_batch_commit() failed\n");
+	if (d->jfd != -1) {
+		if (d->nmem && journal_flush(d))
+			fprintf(stderr, "data_close: journal_flush() failed\n");
+		close(d->jfd);
+	}
+	if (d->db != NULL)
+		data_detach(d);
+	if (debug > 0)
+		print_stats(d->fn, d->ops, inblock() - d->inblock);
+	mem_clear(d);
+	name_clear(d);
+	last_close(&d->lt);
+	change_close(d);
+	free(d->jfn);
+	free(d->kfn);
+	free(d->kbuf);
+	free(d->batch);
+	free(d);
+	return (0);
+}
+
+int
+data_cache_open(struct data *d, const char *filename)
+{
+	BTREEINFO bti;
+	unsigned i;
+
+	d->cfn = filename;
+	memset(&bti, 0, sizeof(bti));
+	d->cdb = dbopen(d->cfn, O_CREAT|O_EXLOCK|O_RDWR, 0600, DB_BTREE,
+	    &bti);
+	if (d->cdb == NULL) {
+		fprintf(stderr, "dbopen: %s: %s\n", d->cfn, strerror(errno));
+		return (1);
+	}
+	if (d->shard != NULL)
+		for (i = 0; i < d->conf.shards; ++i)
+			if (d->shard[i] != NULL) {
+				d->shard[i]->cfn = d->cfn;
+				d->shard[i]->cdb = d->cdb;
+			}
+	return (0);
+}
+
+int
+data_cache_close(struct data *d)
+{
+	unsigned i;
+
+	if (d->cdb == NULL)
+		return (0);
+	if (d->shard != NULL)
+		for (i = 0; i < d->conf.shards; ++i)
+			if (d->shard[i] != NULL)
+				d->shard[i]->cdb = NULL;
+	if (d->cdb->close(d->cdb))
+		fprintf(stderr, "dbclose: %s: %s\n", d->cfn, strerror(errno));
+	d->cdb = NULL;
+	return (0);
+}
+
+/*
+ * Shard i for an operation on the whole set, or NULL if the file does
+ * not exist.  *opened tells whether it has to be closed afterwards, to
+ * release its lock before the next shard is locked.
+ */
+static struct data *
+shard_each(struct data *d, unsigned i, int *opened, int *r)
+{
+	struct data *s;
+
+	*opened = d->shard[i] == NULL;
+	if (*opened && access(d->shardfn[i], F_OK))
+		return (NULL);
+	if ((s = shard_get(d, i)) == NULL)
+		*r = 1;
+	return (s);
+}
+
+int
+data_truncate(struct data *d, unsigned days_detail,
+    unsigned days_compressed)
+{
+	DBT dbk, dbd;
+	struct key k;
+	struct val v;
+	struct data *s;
+	int r = 0, opened;
+	unsigned cutoff[2], i, bucket, unit;
+	unsigned seen = 0, deleted = 0;
+
+	if (change_trim(d, time(NULL) - days_detail * 24 * 60 * 60))
+		return (1);
+	if (d->shard != NULL) {
+		for (i = 0; i < d->conf.shards; ++i) {
+			if ((s = shard_each(d, i, &opened, &r)) == NULL)
+				continue;
+			if (data_truncate(s, days_detail, days_compressed))
+				r = 1;
+			if (opened)
+				shard_close(d, i);
+		}
+		return (r);
+	}
+
+	cutoff[0] = time(NULL) - days_detail * 24 * 60 * 60;
+	cutoff[1] = time(NULL) - days_compressed * 24 * 60 * 60;
+	if (debug > 1)
+		printf("data_truncate: cutoff %u, %u\n", cutoff[0], cutoff[1]);
+	r = dbseq(d, &dbk, &dbd, R_FIRST);
+	if (r < 0)
+		fprintf(stderr, "data_truncate: db->seq(R_FIRST) failed: %s\n",
+		    strerror(errno));
+	while (!r) {
+		seen++;
+		if (key_catalog(d->format, &dbk) || key_gen(d->format, &dbk))
+			goto next;
+		if (key_snap(d->format, &dbk)) {
+			if (dbk.size != SNAP_KEY_SIZE)
+				goto next;
+			snap_unpack(&dbk, &bucket, &unit);
+			if (bucket + level_width[0] > cutoff[0])
+				goto next;
+			goto delete;
+		}
+		if (key_unpack(d->format, &dbk, &k)) {
+			fprintf(stderr, "data_truncate: dbk.size %u != "
+			    "key size %u\n", (unsigned)dbk.size,
+			    (unsigned)KEY_SIZE(d->format));
+			goto delete;
+		}
+		if (!record_valid(&k, &dbd)) {
+			fprintf(stderr, "data_truncate: invalid record: "
+			    "level %u, dbd.size %u\n", (unsigned)k.level,
+			    (unsigned)dbd.size);
+			goto delete;
+		}
+		if (k.level == MAX_LEVEL && k.ts == MAX_TS)
+			goto next;
+		if (last_migrate(&d->lt, d->format, &dbk, &dbd, cutoff[0]))
+			goto delete;
+		if (get_val(&dbd, k.level, &v))
+			goto delete;
+		if (debug > 1)
+			printf("%d, %d, %u, val: %.2f, %.2f, %.2f\n",
+			    (int)k.unit, (int)k.level, (unsigned)k.ts,
+			    v.min, v.avg, v.max);
+		if (k.ts >= cutoff[k.level > 0])
+			goto next;
+delete:
+		r = dbdel(d, &dbk, 0);
+		if (r < 0) {
+			fprintf(stderr, "data_truncate: db->del() failed: %s\n",
+			    strerror(errno));
+			return (1);
+		}
+		if (r > 0) {
+			fprintf(stderr, "data_truncate: db->del() "
+			    "returned %d\n", r);
+			return (1);
+		}
+		deleted++;
+next:
+		r = dbseq(d, &dbk, &dbd, R_NEXT);
+		if (r < 0)
+			fprintf(stderr, "db->seq(R_NEXT) failed: %s\n",
+			    strerror(errno));
+	}
+	last_expire(&d->lt, cutoff[0]);
+	if (debug > 0)
+		printf("data_truncate: %u of %u entries deleted\n",
+		    deleted, seen);
+	return (0);
+}
+
+/* bytes a record takes on a leaf page besides key and data, about */
+#define	LEAF_OVERHEAD	12
+
+static int
+name_unit_cmp(const void *a, const void *b)
+{
+	const struct name *x = *(struct name * const *)a;
+	const struct name *y = *(struct name * const *)b;
+
+	return (x->unit < y->unit ? -1 : x->unit > y->unit);
+}
+
+/* list the series names of the catalog, in order of their units */
+static int
+catalog_list(struct data *d, struct name ***names, unsigned *n)
+{
+	struct name **l = NULL, **t, *e;
+	unsigned max = 0;
+	u_int32_t u;
+	DBT dbk, dbd;
+	int r;
+
+	*names = NULL;
+	*n = 0;
+	if (d->format < 3)
+		return (0);
+	memset(&dbk, 0, sizeof(dbk));
+	dbk.size = 4;
+	dbk.data = "\xff\xff\xff\xff";
+	for (r = dbseq(d, &dbk, &dbd, R_CURSOR); !r;
+	    r = dbseq(d, &dbk, &dbd, R_NEXT)) {
+		if (!key_catalog(d->format, &dbk))
+			break;
+		if (dbk.size == 4 || dbk.size > KEY_MAX ||
+		    dbd.size != sizeof(u) || dbd.data == NULL)
+			continue;
+		if (*n == max) {
+			max = max ? 2 * max : 256;
+			if ((t = reallocarray(l, max, sizeof(*l))) == NULL)
+				goto fail;
+			l = t;
+		}
+		if ((e = malloc(sizeof(*e) + dbk.size - 4 + 1)) == NULL)
+			goto fail;
+		memcpy(e->name, (char *)dbk.data + 4, dbk.size - 4);
+		e->name[dbk.size - 4] = 0;
+		memcpy(&u, dbd.data, sizeof(u));
+		e->unit = ntohl(u);
+		l[(*n)++] = e;
+	}
+	if (*n)
+		qsort(l, *n, sizeof(*l), name_unit_cmp);
+	*names = l;
+	return (0);
+
+fail:
+	fprintf(stderr, "data_stats: malloc: %s\n", strerror(errno));
+	while (*n)
+		free(l[--*n]);
+	free(l);
+	return (1);
+}
+
+static const char *
+stats_name(struct name **names, unsigned n, unsigned unit)
+{
+	struct name key, *k = &key, **e;
+
+	key.unit = unit;
+	e = bsearch(&k, names, n, sizeof(*names), name_unit_cmp);
+	return (e != NULL ? (*e)->name : "");
+}
+
+static const char *
+stats_time(unsigned ts, char *buf, size_t len)
+{
+	time_t t = ts;
+
+	strftime(buf, len, "%Y-%m-%d %H:%M", localtime(&t));
+	return (buf);
+}
+
+/*
+ * Print the units and levels of a database, seeking from one to the
+ * next.  Time ranges come from the first and last record, the number
+ * of values of level 0 from the rollups above, see summary_level(),
+ * and that of compressed entries from their time range, assuming one
+ * per bucket.  Bytes are estimated from the size of the first record.
+ */
+static int
+stats_file(struct data *d, struct name **names, unsigned nnames)
+{
+	u_int8_t kb[KEY_SIZE_3];
+	char b0[32], b1[32];
+	DBT dbk, dbd;
+	struct key k;
+	struct stat st;
+	struct data_summary s;
+	unsigned unit, level, first, last, psize, lag;
+	unsigned prev = 0, punit = 0, plevel = MAX_LEVEL;
+	double records, bytes, total = 0.0;
+	size_t size;
+	int r;
+
+	if (stat(d->fn, &st)) {
+		fprintf(stderr, "data_stats: stat: %s: %s\n", d->fn,
+		    strerror(errno));
+		return (1);
+	}
+	printf("%s: format %u, %lld bytes", d->fn, d->format,
+	    (long long)st.st_size);
+	if ((psize = data_psize(d->fn)) != 0)
+		printf(", page size %u, %lld pages", psize,
+		    (long long)st.st_size / psize);
+	printf("\n");
+	printf("%10s %5s %10s %-16s %-16s %12s %8s %s\n", "unit", "level",
+	    "records", "first", "last", "bytes", "lag", "name");
+	k.unit = 0;
+	k.level = 0;
+	k.ts = 0;
+	for (;;) {
+		key_pack(d->format, &k, kb, &dbk);
+		if ((r = dbseq(d, &dbk, &dbd, R_CURSOR)) < 0) {
+			fprintf(stderr, "data_stats: db->seq: %s\n",
+			    strerror(errno));
+			return (1);
+		}
+		/* the catalog follows all units */
+		if (r || key_unpack(d->format, &dbk, &k))
+			break;
+		if (k.level == MAX_LEVEL) {
+			if (k.unit == MAX_UNIT || (d->format < 3 &&
+			    k.unit == 0xffff))
+				break;
+			k.unit++;
+			k.level = 0;
+			k.ts = 0;
+			continue;
+		}
+		unit = k.unit;
+		level = k.level;
+		first = k.ts;
+		size = dbk.size + dbd.size + LEAF_OVERHEAD;
+		last = find_highest_ts(d, unit, level);
+		if (level >= NLEVELS) {
+			printf("%10u %5u %10s %-16s %-16s %12s %8s %s\n",
+			    unit, level, "-", stats_time(first, b0, sizeof(b0)),
+			    stats_time(last, b1, sizeof(b1)), "-", "orphaned",
+			    stats_name(names, nnames, unit));
+			goto next;
+		}
+		lag = 0;
+		if (level == 0) {
+			memset(&s, 0, sizeof(s));
+			s.min = DBL_MAX;
+			s.max = -DBL_MAX;
+			if (summary_level(d, unit, NLEVELS - 1, first,
+			    last < MAX_TS ? last + 1 : last, &s))
+				return (1);
+			records = s.count;
+		} else {
+			records = (last - first) / level_width[level] + 1;
+			/* complete buckets of the level below not rolled up */
+			if (punit == unit && plevel == level - 1) {
+				prev -= prev % level_width[level];
+				if (prev > last + level_width[level])
+					lag = prev - last - level_width[level];
+			}
+		}
+		bytes = records * size;
+		total += bytes;
+		printf("%10u %5u %10.0f %-16s %-16s %12.0f %8u %s\n", unit,
+		    level, records, stats_time(first, b0, sizeof(b0)),
+		    stats_time(last, b1, sizeof(b1)), bytes, lag,
+		    stats_name(names, nnames, unit));
+next:
+		prev = last;
+		punit = unit;
+		plevel = level;
+		k.unit = unit;
+		k.level = level + 1;
+		k.ts = 0;
+	}
+	printf("%s: records take about %.0f bytes, %.1f%% of the file, "
+	    "%.0f bytes free\n", d->fn, total, st.st_size ?
+	    100.0 * total / st.st_size : 0.0, st.st_size > total ?
+	    st.st_size - total : 0.0);
+	return (0);
+}
 
-		memset(&k, 0, sizeof(k));
-		k.unit = htons(unit);
-		k.level = htons(level);
-		k.ts = htonl(beg);
-		memset(&dbk, 0, sizeof(dbk));
-		dbk.size = sizeof(k);
-		dbk.data = &k;
+/*
+ * Report records, time range, bytes and rollup lag per unit and level,
+ * and how full the database is, without reading all records.
+ */
+int
+data_stats(struct data *d)
+{
+	struct name **names = NULL;
+	struct data *s;
+	unsigned i, n = 0;
+	int r = 0, opened;
+	struct changehdr h;
+	u_int64_t last;
 
-		for (r = db->seq(db, &dbk, &dbd, R_CURSOR); !r;
-		    r = db->seq(db, &dbk, &dbd, R_NEXT)) {
-			if (dbk.size != sizeof(k) || !dbk.data)
-				break;
-			memcpy(&k, dbk.data, sizeof(k));
-			k.unit = ntohs(k.unit);
-			k.level = ntohs(k.level);
-			k.ts = ntohs(k.ts);
-			if (k.unit != unit || k.level != level || k.ts > end)
-				break;
-			++count;
+	if (d->chfd != -1) {
+		if (change_header(d, &h, &last))
+			return (1);
+		printf("%s: changes %llu to %llu\n", d->chfn,
+		    (unsigned long long)h.base + 1, (unsigned long long)last);
+	}
+	if (d->shard != NULL) {
+		/* the catalog is kept by the first shard */
+		if ((s = shard_each(d, 0, &opened, &r)) != NULL) {
+			if (catalog_list(s, &names, &n))
+				r = 1;
+			if (opened)
+				shard_close(d, 0);
 		}
-		if (debug > 0)
-			printf("get_values_find_level: found %u entries "
-			    "for level %d\n", count, (int)level);
-		if (siz + 32 <= count) {
-			if (debug > 0)
-				printf("get_values_find_level: siz %u + 32 "
-				    "<= count %u, using level %d\n",
-				    siz, count, (int)level);
-			break;
+		for (i = 0; i < d->conf.shards; ++i) {
+			if ((s = shard_each(d, i, &opened, &r)) == NULL)
+				continue;
+			if (stats_file(s, names, n))
+				r = 1;
+			if (opened)
+				shard_close(d, i);
 		}
-		--level;
-	}
-	if (debug > 0)
-		printf("get_values_find_level(unit %d, beg %u, end %u, siz %u) "
-		    "returning level %d\n", (int)unit, beg, end, siz, level);
-	return (level);
+	} else if (catalog_list(d, &names, &n) || stats_file(d, names, n))
+		r = 1;
+	for (i = 0; i < n; ++i)
+		free(names[i]);
+	free(names);
+	return (r);
 }
 
-static inline double
-intersect(double sa, double sb, double pa, double pb)
+/* the catalog of a database, or of a set, kept by its first shard */
+static int
+catalog_names(struct data *d, struct name ***names, unsigned *n)
 {
-	/* sa <= sb && pa <= pb */
-	if (sb <= pa || sa >= pb)
-		return 0.0;
-	if (sa <= pa && sb >= pb)
-		return pb - pa;
-	if (sa >= pa && sb <= pb)
-		return sb - sa;
-	if (sa <= pa)
-		return sb - pa;
-	else
-		return pb - sa;
+	struct data *s;
+	int r = 0, opened;
+
+	*names = NULL;
+	*n = 0;
+	if (d->shard == NULL)
+		return (catalog_list(d, names, n));
+	if ((s = shard_each(d, 0, &opened, &r)) != NULL) {
+		if (catalog_list(s, names, n))
+			r = 1;
+		if (opened)
+			shard_close(d, 0);
+	}
+	return (r);
 }
 
-static inline void
-get_values_resample(unsigned beg, unsigned end, int type, unsigned siz,
-    double *a, double spp, unsigned tt, unsigned ts, double v)
+/*
+ * Copy the points into *out, one allocation holding their series
+ * names as well, and free the names.
+ */
+static int
+points_named(const struct data_point *p, unsigned n, struct name **names,
+    unsigned nnames, struct data_point **out)
 {
-	unsigned i = (unsigned long long)(tt - beg) * siz / (end - beg);
-	unsigned j = (unsigned long long)(ts - beg) * siz / (end - beg);
-	double sa = (double)tt - (double)beg;
-	double sb = (double)ts - (double)beg;
-	double pa, f;
+	struct data_point *t;
+	const char *name;
+	size_t len = 0;
+	unsigned i;
+	char *c;
 
-	if (debug > 2)
-		printf("get_values_resample(beg %u, end %u, type %d, siz %u, "
-		    "spp %.2f, tt %u, ts %u, v %.2f)\n",
-		    beg, end, type, siz, spp, tt, ts, v);
-	if (debug > 2)
-		printf("get_values_resample: enter, i %u, j %u\n", i, j);
-	while (i <= j) {
-		if (debug > 2)
-			printf("get_values_resample: i %u <= j %u\n", i, j);
-		pa = (double)i * spp;
-		if ((f = intersect(sa, sb, pa, pa + spp)) > 0.0) {
-			switch (type) {
-			case DATA_TYPE_AVG:
-				a[i] += v * (f / spp);
-				break;
-			case DATA_TYPE_MAX:
-				if (a[i] < v)
-					a[i] = v;
-				break;
-			case DATA_TYPE_MIN:
-				if (a[i] > v)
-					a[i] = v;
-				break;
-			}
+	for (i = 0; i < n; ++i)
+		if (p[i].unit >= NAMED_UNIT)
+			len += strlen(stats_name(names, nnames, p[i].unit)) + 1;
+	if ((t = malloc(n * sizeof(*p) + len + 1)) == NULL)
+		fprintf(stderr, "data_get: malloc: %s\n", strerror(errno));
+	c = (char *)(t + n);
+	for (i = 0; t != NULL && i < n; ++i) {
+		t[i] = p[i];
+		t[i].name = NULL;
+		if (p[i].unit >= NAMED_UNIT &&
+		    *(name = stats_name(names, nnames, p[i].unit)) != 0) {
+			t[i].name = c;
+			c = stpcpy(c, name) + 1;
 		}
-		++i;
 	}
+	for (i = 0; i < nnames; ++i)
+		free(names[i]);
+	free(names);
+	*out = t;
+	return (t == NULL);
 }
 
-int
-data_get_values(unsigned short unit, unsigned beg, unsigned end, int type,
-    unsigned siz, double *a, int console)
+/*
+ * Merge the values of a bucket of the snapshot index, or of the
+ * journal, in order of units, into the values in *p, also in order of
+ * units, replacing those of the same units.
+ */
+static int
+snapshot_merge(struct data_point **p, unsigned *n,
+    const struct data_point *b, unsigned nb)
 {
-	double spp, d;
-	unsigned i, ts, tt = 0;
-	int level, r;
+	struct data_point *m;
+	unsigned i = 0, j = 0, k = 0;
 
-	if (beg >= end) {
-		fprintf(stderr, "get_values: beg %u >= end %u\n", beg, end);
+	if (nb == 0)
+		return (0);
+	if ((m = reallocarray(NULL, *n + nb, sizeof(*m))) == NULL) {
+		fprintf(stderr, "get_snapshot: reallocarray: %s\n",
+		    strerror(errno));
 		return (1);
 	}
-	if (type != DATA_TYPE_MIN && type != DATA_TYPE_AVG &&
-	    type != DATA_TYPE_MAX) {
-		fprintf(stderr, "get_values: invalid type %d\n", type);
-		return (1);
+	while (i < *n || j < nb) {
+		if (j == nb || (i < *n && (*p)[i].unit < b[j].unit))
+			m[k++] = (*p)[i++];
+		else {
+			if (i < *n && (*p)[i].unit == b[j].unit)
+				i++;
+			m[k++] = b[j++];
+		}
 	}
-	spp = (double)(end - beg) / (double)siz;
-	for (i = 0; i < siz; ++i)
-		a[i] = type == DATA_TYPE_AVG ? 0.0 :
-		    (type == DATA_TYPE_MAX ? -DBL_MAX : DBL_MAX);
-	level = get_values_find_level(unit, beg, end, siz);
-	if (level < 0)
-		return (1);
+	free(*p);
+	*p = m;
+	*n = k;
+	return (0);
+}
 
-	if (debug > 1)
-		printf("get_values: seeking for %d, %d, %u\n", (int)unit,
-		    (int)level, end);
+static int
+snapshot_append(struct data_point **p, unsigned *n, unsigned *max,
+    unsigned unit, unsigned ts, double val)
+{
+	struct data_point *t;
 
-	memset(&k, 0, sizeof(k));
-	k.unit = htons(unit);
-	k.level = htons(level);
-	k.ts = htonl(end);
-	memset(&dbk, 0, sizeof(dbk));
-	dbk.size = sizeof(k);
-	dbk.data = &k;
+	if (*n == *max) {
+		unsigned m = *max ? 2 * *max : 256;
 
-	r = db->seq(db, &dbk, &dbd, R_CURSOR);
-	if (!r) {
-		if (dbk.size != sizeof(k) || !dbk.data)
+		if ((t = reallocarray(*p, m, sizeof(*t))) == NULL) {
+			fprintf(stderr, "get_snapshot: reallocarray: %s\n",
+			    strerror(errno));
 			return (1);
-		memcpy(&k, dbk.data, sizeof(k));
-		k.unit = ntohs(k.unit);
-		k.level = ntohs(k.level);
-		k.ts = ntohl(k.ts);
-		if (debug > 1)
-			printf("get_values: first %d, %d, %u\n", (int)k.unit,
-			    (int)k.level, k.ts);
-		if (k.unit != unit || k.level != level) {
-			if (debug > 1)
-				printf("get_values: first past end, prev\n");
-			r = db->seq(db, &dbk, &dbd, R_PREV);
 		}
+		*p = t;
+		*max = m;
+	}
+	t = &(*p)[(*n)++];
+	t->unit = unit;
+	t->ts = ts;
+	t->val = val;
+	t->name = NULL;
+	return (0);
+}
+
+/*
+ * The last value of every unit in the buckets from beg to end, read
+ * from the snapshot index in a single pass, bucket after bucket, and
+ * from the journal.  Gap markers are kept, to hide earlier values.
+ */
+static int
+snapshot_file(struct data *d, unsigned beg, unsigned end,
+    struct data_point **p, unsigned *n)
+{
+	u_int8_t kb[SNAP_KEY_SIZE];
+	struct data_point *b = NULL;
+	struct mem *m, key;
+	struct snap sn;
+	DBT dbk, dbd;
+	unsigned bucket, last, unit, nb = 0, max = 0, i, nm, *mt;
+	double *mv;
+	int r;
+
+	if (!d->snap) {
+		if (debug > 0)
+			printf("get_snapshot: %s: no snapshot index\n", d->fn);
+		return (0);
 	}
-	for (; !r; r = db->seq(db, &dbk, &dbd, R_PREV)) {
-		if (dbk.size != sizeof(k) || !dbk.data)
+	bucket = beg - beg % level_width[0];
+	last = end - end % level_width[0];
+	snap_pack(bucket, 0, kb, &dbk);
+	for (r = dbseq(d, &dbk, &dbd, R_CURSOR); !r;
+	    r = dbseq(d, &dbk, &dbd, R_NEXT)) {
+		if (!key_snap(d->format, &dbk) || dbk.size != SNAP_KEY_SIZE)
 			break;
-		memcpy(&k, dbk.data, sizeof(k));
-		k.unit = ntohs(k.unit);
-		k.level = ntohs(k.level);
-		k.ts = ntohl(k.ts);
-		if (debug > 1)
-			printf("get_values: got %d, %d, %u\n",
-			    (int)k.unit, (int)k.level, k.ts);
-		if (k.unit != unit || k.level != level || k.ts < beg) {
-			if (debug > 0)
-				printf("get_values: end of sequence\n");
+		snap_unpack(&dbk, &i, &unit);
+		if (i > last)
 			break;
+		if (dbd.size != sizeof(sn) || dbd.data == NULL)
+			continue;
+		if (i != bucket) {
+			if (snapshot_merge(p, n, b, nb))
+				goto fail;
+			nb = 0;
+			bucket = i;
 		}
-		ts = k.ts;
-		if (dbd.size != sizeof(v) || !dbd.data)
+		memcpy(&sn, dbd.data, sizeof(sn));
+		if (snapshot_append(&b, &nb, &max, unit, sn.ts, sn.val))
+			goto fail;
+	}
+	if (r < 0) {
+		fprintf(stderr, "get_snapshot: %s: db->seq: %s\n", d->fn,
+		    strerror(errno));
+		goto fail;
+	}
+	if (snapshot_merge(p, n, b, nb))
+		goto fail;
+	/* values of the journal are later than the stored ones */
+	nb = 0;
+	bucket = beg - beg % level_width[0];
+	last += level_width[0];
+	memset(&key, 0, sizeof(key));
+	for (m = RB_MIN(memtree, &d->mem); m != NULL;
+	    m = RB_NFIND(memtree, &d->mem, &key)) {
+		unit = m->s.unit;
+		if (mem_values(d, unit, &mt, &mv, &nm))
+			goto fail;
+		for (i = nm; i > 0 && mt[i - 1] >= last; --i)
+			;
+		r = i > 0 && mt[i - 1] >= bucket &&
+		    snapshot_append(&b, &nb, &max, unit, mt[i - 1], mv[i - 1]);
+		free(mt);
+		free(mv);
+		if (r)
+			goto fail;
+		if (unit == MAX_UNIT)
 			break;
-		memcpy(&v, dbd.data, sizeof(v));
-		if (type == DATA_TYPE_MIN)
-			d = v.min;
-		else if (type == DATA_TYPE_AVG)
-			d = v.avg;
-		else
-			d = v.max;
-
-		if (debug > 1)
-			printf("get_values: tt %u, ts %u, diff %u, v %.2f\n",
-			    tt, ts, tt - ts, d);
-		get_values_resample(beg, end, type, siz, a, spp,
-		    ts >= beg ? ts : beg, tt ? tt : end, d);
-		tt = ts;
+		key.s.unit = unit + 1;
 	}
+	if (snapshot_merge(p, n, b, nb))
+		goto fail;
+	free(b);
+	return (0);
 
-	for (i = 0; i < siz; ++i)
-		if (a[i] <= -DBL_MAX || a[i] >= DBL_MAX)
-			a[i] = 0.0;
-	if (debug) {
-		d = -DBL_MAX;
-		for (i = 0; i < siz; ++i)
-			if (a[i] > d)
-				d = a[i];
-		if (debug > 0)
-			printf("get_values: maximum (%u values) %.2f\n",
-			    siz, d);
+fail:
+	free(b);
+	return (1);
+}
+
+/*
+ * Get the value of every unit at end, its last one stored within the
+ * minute of end or the ones before, back to beg, from the snapshot
+ * index kept with conf.snapshot.  Seeking every unit for it would take
+ * a seek per unit instead.  *points is allocated in one piece with the
+ * series names, and is freed by the caller.
+ */
+int
+data_get_snapshot(struct data *d, unsigned beg, unsigned end,
+    struct data_point **points, unsigned *npoints)
+{
+	struct data_point *p = NULL;
+	struct name **names;
+	struct data *s;
+	unsigned long ops = d->ops;
+	long blocks = inblock();
+	unsigned i, j, n = 0, nnames;
+	int r = 0, opened;
+
+	*points = NULL;
+	*npoints = 0;
+	if (beg > end) {
+		fprintf(stderr, "get_snapshot: beg %u > end %u\n", beg, end);
+		return (1);
 	}
-	if (console) {
-		double carray[siz];
-		double cprev = DBL_MAX, ptop = -DBL_MAX, ctop = -DBL_MAX;
-		double psum = 0, csum = 0;
-		int pregister = 0, cshow = 0;
+	if (catalog_names(d, &names, &nnames))
+		return (1);
+	if (d->shard != NULL) {
+		for (i = 0; i < d->conf.shards && !r; ++i) {
+			if ((s = shard_each(d, i, &opened, &r)) == NULL)
+				continue;
+			if (snapshot_file(s, beg, end, &p, &n))
+				r = 1;
+			if (opened)
+				shard_close(d, i);
+		}
+	} else
+		r = snapshot_file(d, beg, end, &p, &n);
+	/* gap markers, no value at end */
+	for (i = j = 0; i < n; ++i)
+		if (!isnan(p[i].val))
+			p[j++] = p[i];
+	n = j;
+	if (points_named(p, n, names, nnames, points))
+		r = 1;
+	free(p);
+	if (r) {
+		free(*points);
+		*points = NULL;
+		return (1);
+	}
+	*npoints = n;
+	if (debug > 0) {
+		printf("get_snapshot(beg %u, end %u) %u units\n", beg, end, n);
+		print_stats("get_snapshot", d->ops - ops, inblock() - blocks);
+	}
+	return (0);
+}
 
-		// get max value
-		for (i = 0; i < siz; ++i)
-			if (a[i] > ptop)
-				ptop = a[i];
+/* a unit and an upper bound of its value, see top_file() */
+struct top {
+	unsigned	 unit;
+	double		 bound;
+};
 
-		for(i = 0; i < siz; ++i)
-			carray[i] = 0; // set all to 0
-		for(i = 0; i < siz; ++i) {
-			if (debug) {
-				printf("%.2f ", a[i]); // print all values
+static int
+top_cmp(const void *a, const void *b)
+{
+	const struct top *x = a, *y = b;
+
+	return (x->bound > y->bound ? -1 : x->bound < y->bound);
+}
+
+/* units with records or values in the journal, in order */
+static int
+top_units(struct data *d, struct top **t, unsigned *n)
+{
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	struct mem *m, key;
+	unsigned max = 0, unit = 0, i, nd;
+	struct top *p;
+	int r;
+
+	*t = NULL;
+	*n = 0;
+	memset(&key, 0, sizeof(key));
+	m = RB_MIN(memtree, &d->mem);
+	for (;;) {
+		k.unit = unit;
+		k.level = 0;
+		k.ts = 0;
+		key_pack(d->format, &k, kb, &dbk);
+		/* the catalog follows all units */
+		if ((r = dbseq(d, &dbk, &dbd, R_CURSOR)) < 0) {
+			fprintf(stderr, "get_top: %s: db->seq: %s\n", d->fn,
+			    strerror(errno));
+			return (1);
+		}
+		if (r || key_unpack(d->format, &dbk, &k))
+			break;
+		unit = k.unit;
+		if (k.level != MAX_LEVEL) {
+			if (*n == max) {
+				max = max ? 2 * max : 256;
+				if ((p = reallocarray(*t, max,
+				    sizeof(*p))) == NULL)
+					goto fail;
+				*t = p;
 			}
-			if (a[i] != 0 && a[i] != cprev) {
-				// add if prevous value is different
-				carray[i] = a[i];
-				// increase values counter
-				pregister += 1;
+			(*t)[(*n)++].unit = unit;
+		}
+		if (unit == MAX_UNIT || (d->format < 3 && unit == 0xffff))
+			break;
+		unit++;
+	}
+	/* units only in the journal yet */
+	nd = *n;
+	for (i = 0; m != NULL; m = RB_NFIND(memtree, &d->mem, &key)) {
+		unit = m->s.unit;
+		while (i < nd && (*t)[i].unit < unit)
+			i++;
+		if (i == nd || (*t)[i].unit != unit) {
+			if (*n == max) {
+				max = max ? 2 * max : 256;
+				if ((p = reallocarray(*t, max,
+				    sizeof(*p))) == NULL)
+					goto fail;
+				*t = p;
 			}
-			// safe previous value for next iteration
-			cprev = a[i];
+			(*t)[(*n)++].unit = unit;
 		}
-		if (debug)
-			printf("\n");
+		if (unit == MAX_UNIT)
+			break;
+		key.s.unit = unit + 1;
+	}
+	return (0);
 
-		// save values counter for next cycle
-		level = pregister;
-		pregister = 0;
-		// if less than 16 values print them
-		if (level < 16)
-			cshow = 1;
-		printf("queue: ");
-		for(i = 0; i < siz; ++i) {
-			if (carray[i] == 0)
-				continue;
-			if (debug) {
-				// print all values in debug mode
-				printf("%.2f ", carray[i]);
-			}
-			psum += carray[i];
-			pregister += 1;
-			// print last 16 values
-			if ((level - pregister) == 15)
-				cshow = 1;
-			if (cshow) {
-				printf("%.2f ", carray[i]);
-				if (carray[i] > ctop) {
-					// save current top, last 16
-					ctop = carray[i];
-				}
-				csum += carray[i];
-				cshow++; // increase to calculate 'csum'
-			}
+fail:
+	fprintf(stderr, "get_top: reallocarray: %s\n", strerror(errno));
+	free(*t);
+	*t = NULL;
+	*n = 0;
+	return (1);
+}
+
+static void
+top_sift(struct data_point *h, unsigned n, unsigned i)
+{
+	struct data_point x;
+	unsigned c;
+
+	for (; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && h[c + 1].val < h[c].val)
+			c++;
+		if (h[i].val <= h[c].val)
+			break;
+		x = h[i];
+		h[i] = h[c];
+		h[c] = x;
+	}
+}
+
+/*
+ * Rank the units of a file into the heap of the k highest values, its
+ * lowest first.  An upper bound of every unit is taken first from the
+ * whole buckets of the coarsest level not wider than the range, which
+ * cover it with a few records: the maximum of a superset of the values
+ * is no lower than their maximum or average.  Units are then summarized
+ * exactly in order of their bounds, until the bound is not above the
+ * lowest value in the heap.
+ */
+static int
+top_file(struct data *d, int type, unsigned k, unsigned beg, unsigned end,
+    struct data_point *heap, unsigned *nheap)
+{
+	struct data_summary s;
+	struct data_point p;
+	struct top *t;
+	unsigned i, j, n, nb = 0, w, b, e, done = 0;
+	int level, bl;
+	double v;
+
+	if (top_units(d, &t, &n))
+		return (1);
+	for (bl = NLEVELS - 1; bl > 0 && level_width[bl] > end - beg; --bl)
+		;
+	w = level_width[bl];
+	b = beg - beg % w;
+	e = end - end % w;
+	e = e > MAX_TS - w ? MAX_TS : e + w;
+	for (i = 0; i < n; ++i) {
+		memset(&s, 0, sizeof(s));
+		s.min = DBL_MAX;
+		s.max = -DBL_MAX;
+		if (summary_level(d, t[i].unit, bl, b, e, &s)) {
+			free(t);
+			return (1);
 		}
-		if (pregister) {
-			printf("\n");
-			// period
-			printf("pavg: %.2f, pmax: %.2f\n", psum/pregister, ptop);
-			// current
-			printf("cavg: %.2f, cmax: %.2f\n", csum/cshow, ctop);
-		} else {
-			printf("0\n");
-			// period
-			printf("pavg: 0.00, pmax: 0.00\n");
-			// current
-			printf("cavg: 0.00, cmax: 0.00\n");
+		if (s.count > 0.0) {
+			t[nb].unit = t[i].unit;
+			t[nb++].bound = s.max;
+		}
+	}
+	qsort(t, nb, sizeof(*t), top_cmp);
+	for (i = 0; i < nb; ++i) {
+		if (*nheap == k && t[i].bound <= heap[0].val)
+			break;
+		memset(&s, 0, sizeof(s));
+		s.min = DBL_MAX;
+		s.max = -DBL_MAX;
+		level = find_highest_level(d, t[i].unit);
+		if (level >= NLEVELS)
+			level = NLEVELS - 1;
+		if (summary_level(d, t[i].unit, level, beg,
+		    end < MAX_TS ? end + 1 : end, &s)) {
+			free(t);
+			return (1);
+		}
+		done++;
+		if (s.count <= 0.0)
+			continue;
+		v = type == DATA_TYPE_MAX ? s.max : s.sum / s.count;
+		p.unit = t[i].unit;
+		p.ts = end;
+		p.val = v;
+		p.name = NULL;
+		if (*nheap < k) {
+			/* kept as a heap once full */
+			heap[(*nheap)++] = p;
+			if (*nheap == k)
+				for (j = k / 2; j-- > 0; )
+					top_sift(heap, k, j);
+		} else if (v > heap[0].val) {
+			heap[0] = p;
+			top_sift(heap, k, 0);
 		}
 	}
+	if (debug > 0)
+		printf("get_top: %s: %u units, %u with values, %u summarized\n",
+		    d->fn, n, nb, done);
+	free(t);
 	return (0);
 }
 
+static int
+data_point_cmp(const void *a, const void *b)
+{
+	const struct data_point *x = a, *y = b;
+
+	return (x->val > y->val ? -1 : x->val < y->val);
+}
+
+/*
+ * Get the k units with the highest maximum or average, by type, from
+ * beg to end, highest first, each with end as ts.  *points is allocated
+ * in one piece with the series names, and is freed by the caller.
+ */
 int
-data_open(const char *filename)
+data_get_top(struct data *d, int type, unsigned k, unsigned beg,
+    unsigned end, struct data_point **points, unsigned *npoints)
 {
-	fn = filename;
-	memset(&btreeinfo, 0, sizeof(btreeinfo));
-	db = dbopen(fn, O_CREAT|O_EXLOCK|O_RDWR, 0600,
-	    DB_BTREE, &btreeinfo);
-	if (db == NULL) {
-		fprintf(stderr, "dbopen: %s: %s\n", fn, strerror(errno));
+	struct data_point *heap;
+	struct name **names;
+	struct data *s;
+	unsigned long ops = d->ops;
+	long blocks = inblock();
+	unsigned i, n = 0, nnames;
+	int r = 0, opened;
+
+	*points = NULL;
+	*npoints = 0;
+	if ((type != DATA_TYPE_MAX && type != DATA_TYPE_AVG) || k == 0 ||
+	    beg >= end) {
+		fprintf(stderr, "get_top: invalid query\n");
+		return (1);
+	}
+	if ((heap = reallocarray(NULL, k, sizeof(*heap))) == NULL) {
+		fprintf(stderr, "get_top: reallocarray: %s\n", strerror(errno));
+		return (1);
+	}
+	if (catalog_names(d, &names, &nnames)) {
+		free(heap);
+		return (1);
+	}
+	/* one heap for all shards, the bound rises with each */
+	if (d->shard != NULL) {
+		for (i = 0; i < d->conf.shards && !r; ++i) {
+			if ((s = shard_each(d, i, &opened, &r)) == NULL)
+				continue;
+			if (top_file(s, type, k, beg, end, heap, &n))
+				r = 1;
+			if (opened)
+				shard_close(d, i);
+		}
+	} else
+		r = top_file(d, type, k, beg, end, heap, &n);
+	qsort(heap, n, sizeof(*heap), data_point_cmp);
+	if (points_named(heap, n, names, nnames, points))
+		r = 1;
+	free(heap);
+	if (r) {
+		free(*points);
+		*points = NULL;
 		return (1);
 	}
+	*npoints = n;
+	if (debug > 0)
+		print_stats("get_top", d->ops - ops, inblock() - blocks);
 	return (0);
 }
 
+/*
+ * Write the changes after sequence number seq, one per line as "seq
+ * since ts flags value unit [name]", for data_put_value() on another
+ * database.  Series names are given, as their units differ between
+ * databases.  The log is locked meanwhile, so writers wait.
+ */
 int
-data_close()
+data_export(struct data *d, unsigned long long seq, FILE *fp)
+{
+	struct sample buf[1024];
+	struct name **names = NULL;
+	struct changehdr h;
+	u_int64_t last;
+	const char *name;
+	unsigned i, n = 0;
+	ssize_t len;
+	off_t off;
+	int r = 0;
+
+	if (d->chfd == -1) {
+		fprintf(stderr, "data_export: %s: no log of changes\n", d->fn);
+		return (1);
+	}
+	if (catalog_names(d, &names, &n))
+		return (1);
+	flock(d->chfd, LOCK_SH);
+	if (change_header(d, &h, &last)) {
+		r = 1;
+		goto unlock;
+	}
+	if (seq < h.base) {
+		fprintf(stderr, "data_export: %s: changes up to %llu are "
+		    "truncated\n", d->chfn, (unsigned long long)h.base);
+		r = 1;
+		goto unlock;
+	}
+	if (debug > 0)
+		printf("data_export: changes %llu to %llu\n", seq + 1,
+		    (unsigned long long)last);
+	off = sizeof(h) + (seq - h.base) * sizeof(*buf);
+	while (seq < last) {
+		if ((len = pread(d->chfd, buf, sizeof(buf), off)) <= 0) {
+			fprintf(stderr, "data_export: read: %s: %s\n",
+			    d->chfn, len ? strerror(errno) : "short read");
+			r = 1;
+			break;
+		}
+		for (i = 0; i < len / sizeof(*buf) && seq < last; ++i) {
+			name = buf[i].unit >= NAMED_UNIT ?
+			    stats_name(names, n, buf[i].unit) : NULL;
+			fprintf(fp, "%llu %u %u %d %.17g %u%s%s\n", ++seq,
+			    buf[i].since, buf[i].ts, buf[i].flags, buf[i].val,
+			    buf[i].unit, name != NULL ? " " : "",
+			    name != NULL ? name : "");
+		}
+		off += len / sizeof(*buf) * sizeof(*buf);
+	}
+	if (fflush(fp)) {
+		fprintf(stderr, "data_export: write: %s\n", strerror(errno));
+		r = 1;
+	}
+unlock:
+	flock(d->chfd, LOCK_UN);
+	for (i = 0; i < n; ++i)
+		free(names[i]);
+	free(names);
+	return (r);
+}
+
+/*
+ * Pack a key of a database of format f again into kb for the current
+ * format, in nkey.  Fails for keys of no record kept.
+ */
+static int
+compact_key(unsigned f, const DBT *key, u_int8_t *kb, DBT *nkey)
 {
-	if (db->sync(db, 0))
-		fprintf(stderr, "dbsync: %s: %s\n", fn, strerror(errno));
-	if (db->close(db))
-		fprintf(stderr, "dbclose: %s: %s\n", fn, strerror(errno));
-	return (0);
+	struct key k;
+
+	if (key_catalog(f, key) || key_snap(f, key) || key_gen(f, key)) {
+		*nkey = *key;
+		return (key->size <= KEY_MAX);
+	}
+	if (key_unpack(f, key, &k))
+		return (0);
+	key_pack(DATA_FORMAT, &k, kb, nkey);
+	return (1);
 }
 
-int
-data_truncate(unsigned days_detail, unsigned days_compressed)
+/*
+ * Keep a record of a database of format f when compacting, valid and
+ * not on an orphaned level.  Its key is packed again into kb for the
+ * current format, in nkey.
+ */
+static int
+compact_keep(unsigned f, const DBT *key, const DBT *data, int drop,
+    u_int8_t *kb, DBT *nkey)
 {
-	int r;
-	unsigned cutoff[2];
-	unsigned seen = 0, deleted = 0;
+	struct key k;
 
-	cutoff[0] = time(NULL) - days_detail * 24 * 60 * 60;
-	cutoff[1] = time(NULL) - days_compressed * 24 * 60 * 60;
-	if (debug > 1)
-		printf("data_truncate: cutoff %u, %u\n", cutoff[0], cutoff[1]);
-	r = db->seq(db, &dbk, &dbd, R_FIRST);
-	if (r < 0)
-		fprintf(stderr, "data_truncate: db->seq(R_FIRST) failed: %s\n",
-		    strerror(errno));
-	while (!r) {
-		seen++;
-		if (dbk.size != sizeof(k) || !dbk.data) {
-			fprintf(stderr, "data_truncate: dbk.size %u != "
-			    "sizeof(k) %u\n", (unsigned)dbk.size,
-			    (unsigned)sizeof(k));
-			goto delete;
-		}
-		memcpy(&k, dbk.data, sizeof(k));
-		k.unit = ntohs(k.unit);
-		k.level = ntohs(k.level);
-		k.ts = ntohl(k.ts);
-		if (k.level == MAX_LEVEL) {
-			if (dbd.size != sizeof(l) || !dbd.data) {
-				fprintf(stderr, "data_truncate: dbd.size %u "
-				    "!= sizeof(l) %u\n", (unsigned)dbd.size,
-				    (unsigned)sizeof(l));
-				goto delete;
-			}
-			memcpy(&l, dbd.data, sizeof(l));
-			if (debug > 1)
-				printf("%d, %d, %u, last: %u, %u, %.2f\n",
-				    (int)k.unit, (int)k.level, (unsigned)k.ts,
-				    l.since, l.ts, l.val);
-			if (l.ts < cutoff[0])
-				goto delete;
-			else
-				goto next;
-		} else {
-			if (dbd.size != sizeof(v) || !dbd.data) {
-				fprintf(stderr, "data_truncate: dbd.size %u "
-				    "!= sizeof(v) %u\n", (unsigned)dbd.size,
-				    (unsigned)sizeof(v));
-				goto delete;
-			}
-			memcpy(&v, dbd.data, sizeof(v));
-			if (debug > 1)
-				printf("%d, %d, %u, val: %.2f, %.2f, %.2f\n",
-				    (int)k.unit, (int)k.level, (unsigned)k.ts,
-				    v.min, v.avg, v.max);
-			if (k.ts < cutoff[k.level > 0])
-				goto delete;
-			else
-				goto next;
-		}
-delete:
-		r = db->del(db, &dbk, 0);
-		if (r < 0) {
-			fprintf(stderr, "data_truncate: db->del() failed: %s\n",
-			    strerror(errno));
-			return (1);
-		}
-		if (r > 0) {
-			fprintf(stderr, "data_truncate: db->del() "
-			    "returned %d\n", r);
-			return (1);
-		}
-		deleted++;
-next:
-		r = db->seq(db, &dbk, &dbd, R_NEXT);
-		if (r < 0)
-			fprintf(stderr, "db->seq(R_NEXT) failed: %s\n",
-			    strerror(errno));
-	}
-	if (debug > 0)
-		printf("data_truncate: %u of %u entries deleted\n",
-		    deleted, seen);
-	return (0);
+	if (!compact_key(f, key, kb, nkey))
+		return (0);
+	/* the catalog, the snapshot index and the generation */
+	if (key_unpack(f, key, &k))
+		return (1);
+	if (!record_valid(&k, data))
+		return (0);
+	/* last values, moved to the table by last_migrate() */
+	if (k.level == MAX_LEVEL && k.ts != MAX_TS)
+		return (0);
+	if (drop && k.level != MAX_LEVEL && k.level >= NLEVELS)
+		return (0);
+	return (1);
 }
 
 int
-data_copy(const char *filename)
+data_copy(struct data *d, const char *filename)
 {
+	char fn[1024];
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd, nk;
 	BTREEINFO bti2;
 	DB *db2;
-	int r;
-	unsigned count = 0;
+	struct lasttab lt;
+	struct data *s;
+	int r = 0, opened;
+	unsigned count = 0, i;
+	size_t u;
+
+	if (d->shard != NULL) {
+		for (i = 0; i < d->conf.shards; ++i) {
+			if ((s = shard_each(d, i, &opened, &r)) == NULL)
+				continue;
+			snprintf(fn, sizeof(fn), "%s.%u", filename, i);
+			if (data_copy(s, fn))
+				r = 1;
+			if (opened)
+				shard_close(d, i);
+		}
+		return (r);
+	}
 
 	if (debug > 0)
 		printf("data_copy: creating %s\n", filename);
@@ -756,27 +4167,31 @@ data_copy(const char *filename)
 		    strerror(errno));
 		return (1);
 	}
+	if (last_open(&lt, filename, 0) || last_map(&lt, d->lt.nslot)) {
+		last_close(&lt);
+		db2->close(db2);
+		return (1);
+	}
+	for (u = 0; u < d->lt.nslot; ++u)
+		if (d->lt.slot[u].ts)
+			lt.slot[u] = d->lt.slot[u];
 
-	r = db->seq(db, &dbk, &dbd, R_FIRST);
+	r = dbseq(d, &dbk, &dbd, R_FIRST);
 	if (r < 0) {
 		fprintf(stderr, "data_copy: db->seq(R_FIRST) failed: %s\n",
 		    strerror(errno));
+		last_close(&lt);
+		db2->close(db2);
 		return (1);
 	}
 	do {
-		if (dbk.data == NULL || dbk.size != sizeof(k)) {
+		if (last_migrate(&lt, d->format, &dbk, &dbd, 0))
+			count++;
+		else if (!compact_keep(d->format, &dbk, &dbd, 0, kb, &nk)) {
 			fprintf(stderr, "data_copy: invalid record: "
-			    "dbk.size %u (%u)\n", (unsigned)dbk.size,
-			    (unsigned)sizeof(k));
-		} else if (dbd.data == NULL || dbd.size !=
-		    (ntohs(((struct key *)dbk.data)->level) == MAX_LEVEL ?
-		    sizeof(l) : sizeof(v))) {
-			fprintf(stderr, "data_copy: invalid record: level %u, "
-			    "dbd.size %u (%u, %u)\n",
-			    (unsigned)ntohs(((struct key *)dbk.data)->level),
-			    (unsigned)dbd.size, (unsigned)sizeof(l),
-			    (unsigned)sizeof(v));
-		} else if (db2->put(db2, &dbk, &dbd, 0)) {
+			    "dbk.size %u, dbd.size %u\n", (unsigned)dbk.size,
+			    (unsigned)dbd.size);
+		} else if (db2->put(db2, &nk, &dbd, 0)) {
 			fprintf(stderr, "data_copy: db->put: %s\n",
 			    strerror(errno));
 			break;
@@ -785,13 +4200,16 @@ data_copy(const char *filename)
 			if (debug > 1 && count % 10000 == 0)
 				printf(" %u", count);
 		}
-		r = db->seq(db, &dbk, &dbd, R_NEXT);
+		r = dbseq(d, &dbk, &dbd, R_NEXT);
 		if (r < 0)
 			fprintf(stderr, "data_copy: db->seq(R_NEXT) failed: "
 			    "%s\n", strerror(errno));
 	} while (!r);
 	if (debug > 1)
 		printf("\n");
+	if (put_format(db2))
+		fprintf(stderr, "data_copy: db->put: %s\n", strerror(errno));
+	last_close(&lt);
 
 	if (db2->sync(db2, 0))
 		fprintf(stderr, "data_copy: dbsync: %s: %s\n", filename,
@@ -803,3 +4221,636 @@ data_copy(const char *filename)
 		printf("data_copy: %u records copied\n", count);
 	return (0);
 }
+
+/*
+ * Rebuild the rollups of unit from its values at level 0, the first at
+ * beg.  On every level, the buckets from the first one starting at beg
+ * on are deleted, those before are kept, and the values are replayed
+ * like when they were stored, one bucket of level 1 at a time.
+ */
+static int
+rebuild_unit(struct data *d, unsigned unit, unsigned beg, int flags)
+{
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	struct val v;
+	unsigned level, w, bucket = 0, deleted = 0, count = 0;
+	int r, moved;
+
+	for (level = 1; level < NLEVELS; ++level) {
+		w = level_width[level];
+		k.unit = unit;
+		k.level = level;
+		k.ts = beg % w ? beg - beg % w + w : beg;
+		key_pack(d->format, &k, kb, &dbk);
+		for (r = dbseq(d, &dbk, &dbd, R_CURSOR); !r;
+		    r = dbseq(d, &dbk, &dbd, R_NEXT)) {
+			if (key_unpack(d->format, &dbk, &k) ||
+			    k.unit != unit || k.level != level)
+				break;
+			if (dbdel(d, &dbk, 0)) {
+				fprintf(stderr, "data_rebuild: db->del: %s\n",
+				    strerror(errno));
+				return (1);
+			}
+			deleted++;
+		}
+	}
+	w = level_width[1];
+	k.unit = unit;
+	k.level = 0;
+	k.ts = beg;
+	key_pack(d->format, &k, kb, &dbk);
+	for (r = dbseq(d, &dbk, &dbd, R_CURSOR); !r;
+	    r = dbseq(d, &dbk, &dbd, R_NEXT)) {
+		if (key_unpack(d->format, &dbk, &k) || k.unit != unit ||
+		    k.level != 0)
+			break;
+		count++;
+		moved = 0;
+		/* fill the snapshot index in, for values stored before it */
+		if (d->snap && !get_val(&dbd, 0, &v)) {
+			if (snap_put(d, unit, k.ts, v.avg))
+				return (1);
+			moved = 1;
+		}
+		if (k.ts - k.ts % w != bucket) {
+			bucket = k.ts - k.ts % w;
+			if (rollup(d, unit, 0, k.ts, flags))
+				return (1);
+			moved = 1;
+		}
+		/* back to the value, the cursor was moved */
+		if (moved) {
+			key_pack(d->format, &k, kb, &dbk);
+			if (dbseq(d, &dbk, &dbd, R_CURSOR))
+				break;
+		}
+	}
+	if (debug > 0)
+		printf("data_rebuild(unit %u): %u values, %u rollups "
+		    "deleted\n", unit, count, deleted);
+	return (0);
+}
+
+/*
+ * Sketches are kept for the units flags() returns DATA_SKETCH for, and
+ * for units it does not know, -1, if their rollups had them.
+ */
+static int
+rebuild_flags(struct data *d, unsigned unit, int (*flags)(unsigned))
+{
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	int f;
+
+	if ((f = flags(unit)) != -1)
+		return (f);
+	k.unit = unit;
+	k.level = 1;
+	k.ts = 0;
+	key_pack(d->format, &k, kb, &dbk);
+	if (!dbseq(d, &dbk, &dbd, R_CURSOR) &&
+	    !key_unpack(d->format, &dbk, &k) && k.unit == unit &&
+	    k.level > 0 && k.level < NLEVELS && dbd.size > sizeof(struct val))
+		return (DATA_SKETCH);
+	return (0);
+}
+
+struct rebuild {
+	struct data	*d;
+	int		(*flags)(unsigned);
+	pthread_t	 thread;
+	int		 r;
+};
+
+/* rebuild the rollups of the units of a file, seeking from one to the next */
+static void *
+rebuild_file(void *arg)
+{
+	struct rebuild *rb = arg;
+	struct data *d = rb->d;
+	u_int8_t kb[KEY_SIZE_3];
+	DBT dbk, dbd;
+	struct key k;
+	unsigned unit, beg;
+	int r;
+
+	k.unit = 0;
+	k.level = 0;
+	k.ts = 0;
+	key_pack(d->format, &k, kb, &dbk);
+	r = dbseq(d, &dbk, &dbd, R_CURSOR);
+	/* the catalog follows all units */
+	while (!r && !key_unpack(d->format, &dbk, &k)) {
+		unit = k.unit;
+		beg = k.ts;
+		if (k.level == 0 && rebuild_unit(d, unit, beg,
+		    rebuild_flags(d, unit, rb->flags))) {
+			rb->r = 1;
+			return (NULL);
+		}
+		if (d->format < 3 && unit == 0xffff)
+			break;
+		k.unit = unit + 1;
+		k.level = 0;
+		k.ts = 0;
+		key_pack(d->format, &k, kb, &dbk);
+		r = dbseq(d, &dbk, &dbd, R_CURSOR);
+	}
+	if (r < 0) {
+		fprintf(stderr, "data_rebuild: %s: db->seq: %s\n", d->fn,
+		    strerror(errno));
+		rb->r = 1;
+	}
+	if (!rb->r && gen_bump(d))
+		rb->r = 1;
+	return (NULL);
+}
+
+/*
+ * Rebuild the rollups of every unit from its values at level 0, with
+ * the flags given for it by flags(), -1 for units it does not know.
+ * Shards are rebuilt in parallel, a thread for each.
+ */
+int
+data_rebuild(struct data *d, int (*flags)(unsigned unit))
+{
+	struct rebuild *rb;
+	unsigned i;
+	int r = 0, *opened;
+
+	if (d->shard == NULL) {
+		struct rebuild one;
+
+		memset(&one, 0, sizeof(one));
+		one.d = d;
+		one.flags = flags;
+		rebuild_file(&one);
+		return (one.r);
+	}
+	rb = calloc(d->conf.shards, sizeof(*rb));
+	opened = calloc(d->conf.shards, sizeof(*opened));
+	if (rb == NULL || opened == NULL) {
+		fprintf(stderr, "data_rebuild: calloc: %s\n", strerror(errno));
+		free(rb);
+		free(opened);
+		return (1);
+	}
+	/* shards are opened here, not by the threads */
+	for (i = 0; i < d->conf.shards; ++i) {
+		if ((rb[i].d = shard_each(d, i, &opened[i], &r)) == NULL)
+			continue;
+		rb[i].flags = flags;
+		if ((errno = pthread_create(&rb[i].thread, NULL, rebuild_file,
+		    &rb[i]))) {
+			fprintf(stderr, "data_rebuild: pthread_create: %s\n",
+			    strerror(errno));
+			rebuild_file(&rb[i]);
+			if (rb[i].r)
+				r = 1;
+			rb[i].d = NULL;
+		}
+	}
+	for (i = 0; i < d->conf.shards; ++i) {
+		if (rb[i].d != NULL) {
+			pthread_join(rb[i].thread, NULL);
+			if (rb[i].r)
+				r = 1;
+		}
+		if (opened[i])
+			shard_close(d, i);
+	}
+	free(rb);
+	free(opened);
+	return (r);
+}
+
+/*
+ * Copy the file from into to, through a temporary file renamed when
+ * complete.  copy_file_range(2) lets the file system share or copy the
+ * blocks without passing them through the process; where it cannot,
+ * the file is read and written in large chunks.  A missing file is
+ * skipped unless must.
+ */
+static int
+copy_file(const char *from, const char *to, int must)
+{
+	char tmp[1024], buf[65536];
+	ssize_t n, w;
+	off_t off = 0;
+	int fi, fo, range = 1;
+
+	if ((fi = open(from, O_RDONLY)) == -1) {
+		if (!must && errno == ENOENT)
+			return (0);
+		fprintf(stderr, "data_backup: open: %s: %s\n", from,
+		    strerror(errno));
+		return (1);
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", to);
+	if ((fo = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600)) == -1) {
+		fprintf(stderr, "data_backup: open: %s: %s\n", tmp,
+		    strerror(errno));
+		close(fi);
+		return (1);
+	}
+	for (;;) {
+		if (range) {
+			n = copy_file_range(fi, NULL, fo, NULL, 1 << 30, 0);
+			if (n == -1 && off == 0 && (errno == EXDEV ||
+			    errno == EINVAL || errno == ENOSYS ||
+			    errno == EOPNOTSUPP)) {
+				range = 0;
+				continue;
+			}
+		} else if ((n = read(fi, buf, sizeof(buf))) > 0 &&
+		    (w = write(fo, buf, n)) != n) {
+			if (w >= 0)
+				errno = ENOSPC;
+			n = -1;
+		}
+		if (n <= 0)
+			break;
+		off += n;
+	}
+	if (n == 0 && fsync(fo))
+		n = -1;
+	if (n) {
+		fprintf(stderr, "data_backup: %s: %s\n", from,
+		    strerror(errno));
+		close(fi);
+		close(fo);
+		unlink(tmp);
+		return (1);
+	}
+	close(fi);
+	if (close(fo) || rename(tmp, to)) {
+		fprintf(stderr, "data_backup: %s: %s\n", to, strerror(errno));
+		unlink(tmp);
+		return (1);
+	}
+	return (0);
+}
+
+/* a copy of a database made by data_compact() or data_backup() */
+struct compact {
+	const char	*name;	/* of the caller, for messages */
+	const char	*fn;
+	char		 tmp[1024]; /* the new file, renamed when complete */
+	char		 kfn[1024]; /* keys changed meanwhile */
+	int		 kfd;
+	off_t		 off;	/* of the first key not yet merged */
+	DB		*db2;
+	int		 drop;	/* records of levels no longer rolled up into */
+	int		 backup; /* records copied as they are */
+	struct lasttab	 lt;
+	unsigned	 count, keys;
+};
+
+/*
+ * Put a record of the database into the new file, unless it is not
+ * kept.  Returns 1 when put, 0 when not kept and -1 on error.
+ */
+static int
+compact_put(struct compact *c, struct data *d, const DBT *dbk,
+    const DBT *dbd)
+{
+	u_int8_t kb[KEY_SIZE_3];
+	DBT nk;
+
+	if (c->backup)
+		nk = *dbk;
+	else if (last_migrate(&c->lt, d->format, dbk, dbd, 0) ||
+	    !compact_keep(d->format, dbk, dbd, c->drop, kb, &nk))
+		return (0);
+	if (c->db2->put(c->db2, &nk, dbd, 0)) {
+		fprintf(stderr, "%s: db->put: %s\n", c->name, strerror(errno));
+		return (-1);
+	}
+	return (1);
+}
+
+/*
+ * Bring the records of the keys logged from c->off on, at most max of
+ * them unless 0, into the new file as they are in the database,
+ * deleting those it no longer has.  A partial entry at the end of the
+ * log is left for later.
+ */
+static int
+compact_replay(struct compact *c, struct data *d, unsigned max)
+{
+	u_int8_t buf[65536], kb[KEY_SIZE_3];
+	DBT dbk, dbd, nk;
+	ssize_t n, p;
+	unsigned count = 0;
+	int r;
+
+	while (!max || count < max) {
+		if ((n = pread(c->kfd, buf, sizeof(buf), c->off)) == -1) {
+			fprintf(stderr, "%s: read: %s: %s\n", c->name, c->kfn,
+			    strerror(errno));
+			return (1);
+		}
+		for (p = 0; p < n && p + 1 + buf[p] <= n &&
+		    (!max || count < max); p += 1 + buf[p], ++count) {
+			memset(&dbk, 0, sizeof(dbk));
+			dbk.size = buf[p];
+			dbk.data = buf + p + 1;
+			if ((r = dbget(d, &dbk, &dbd, 0)) < 0) {
+				fprintf(stderr, "%s: db->get: %s\n", c->name,
+				    strerror(errno));
+				return (1);
+			}
+			if (!r && (r = compact_put(c, d, &dbk, &dbd)) != 0) {
+				if (r < 0)
+					return (1);
+				continue;
+			}
+			/* deleted meanwhile, or no longer kept */
+			if (c->backup)
+				nk = dbk;
+			else if (!compact_key(d->format, &dbk, kb, &nk))
+				continue;
+			if (c->db2->del(c->db2, &nk, 0) < 0) {
+				fprintf(stderr, "%s: db->del: %s\n", c->name,
+				    strerror(errno));
+				return (1);
+			}
+		}
+		if (p == 0)
+			break;
+		c->off += p;
+	}
+	c->keys += count;
+	return (0);
+}
+
+/*
+ * Lock the log of keys for writers to append to, see compact_log_open().
+ * Another copy holds it until done and removes it, in which case it is
+ * created again.
+ */
+static int
+compact_log_lock(struct compact *c)
+{
+	struct stat st, sn;
+
+	for (;;) {
+		if ((c->kfd = open(c->kfn, O_RDWR|O_CREAT, 0600)) == -1 ||
+		    flock(c->kfd, LOCK_EX)) {
+			fprintf(stderr, "%s: %s: %s\n", c->name, c->kfn,
+			    strerror(errno));
+			if (c->kfd != -1)
+				close(c->kfd);
+			return (1);
+		}
+		if (!fstat(c->kfd, &st) && !stat(c->kfn, &sn) &&
+		    st.st_dev == sn.st_dev && st.st_ino == sn.st_ino)
+			break;
+		close(c->kfd);
+	}
+	if (ftruncate(c->kfd, 0)) {
+		fprintf(stderr, "%s: ftruncate: %s: %s\n", c->name, c->kfn,
+		    strerror(errno));
+		close(c->kfd);
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Copy the database into c->tmp, then rename it to to.  Records are
+ * streamed in key order into an empty tree, which db(3) fills by adding
+ * pages at its right edge, leaving full leaf pages.  The database is
+ * read in chunks under a shared lock, released in between so values
+ * can still be stored.  Writers log the keys they change meanwhile, see
+ * compact_log_open(), and the records of those are brought into the
+ * new file in chunks too, until few are left.  Only the last of them
+ * are merged under a lock held until the new file is renamed, shared
+ * for a backup, which also copies the files kept next to the database
+ * then, and exclusive when it replaces the database.
+ */
+static int
+compact_run(struct compact *c, const char *to, const struct data_conf *conf)
+{
+	char tn[1024];
+	u_int8_t last[KEY_MAX];
+	size_t lastlen = 0;
+	struct data *d;
+	struct stat st;
+	BTREEINFO bti2;
+	DBT dbk, dbd;
+	unsigned chunk, locked;
+	int r, have = 0;
+
+	/* locked before the first chunk, writers log from then on */
+	if (compact_log_lock(c))
+		return (1);
+	if (!c->backup && last_open(&c->lt, c->fn, 0))
+		goto fail;
+	memset(&bti2, 0, sizeof(bti2));
+	bti2.psize = conf->psize;
+	bti2.cachesize = conf->cachesize;
+	c->db2 = dbopen(c->tmp, O_CREAT|O_TRUNC|O_EXLOCK|O_RDWR, 0600,
+	    DB_BTREE, &bti2);
+	if (c->db2 == NULL) {
+		fprintf(stderr, "%s: dbopen: %s: %s\n", c->name, c->tmp,
+		    strerror(errno));
+		goto fail;
+	}
+
+	/* copy in chunks, holding a shared lock for each */
+	do {
+		if ((d = data_open(c->fn, 1, conf)) == NULL)
+			goto fail;
+		memset(&dbk, 0, sizeof(dbk));
+		memset(&dbd, 0, sizeof(dbd));
+		if (have) {
+			dbk.size = lastlen;
+			dbk.data = last;
+			r = dbseq(d, &dbk, &dbd, R_CURSOR);
+			if (!r && dbk.size == lastlen &&
+			    !memcmp(dbk.data, last, lastlen))
+				r = dbseq(d, &dbk, &dbd, R_NEXT);
+		} else
+			r = dbseq(d, &dbk, &dbd, R_FIRST);
+		for (chunk = 0; !r && chunk < 65536; ++chunk) {
+			if ((r = compact_put(c, d, &dbk, &dbd)) < 0) {
+				data_close(d);
+				goto fail;
+			}
+			c->count += r;
+			if (dbk.size <= sizeof(last)) {
+				memcpy(last, dbk.data, dbk.size);
+				lastlen = dbk.size;
+				have = 1;
+			}
+			r = dbseq(d, &dbk, &dbd, R_NEXT);
+		}
+		if (r < 0)
+			fprintf(stderr, "%s: db->seq: %s\n", c->name,
+			    strerror(errno));
+		data_close(d);
+		if (debug > 1)
+			printf("%s: %u records copied\n", c->name, c->count);
+	} while (!r);
+
+	/* catch up with the keys logged meanwhile, a chunk at a time */
+	for (;;) {
+		if (fstat(c->kfd, &st)) {
+			fprintf(stderr, "%s: fstat: %s: %s\n", c->name, c->kfn,
+			    strerror(errno));
+			goto fail;
+		}
+		if (st.st_size - c->off <= 65536)
+			break;
+		if ((d = data_open(c->fn, 1, conf)) == NULL)
+			goto fail;
+		r = compact_replay(c, d, 65536);
+		data_close(d);
+		if (r)
+			goto fail;
+	}
+
+	/* the last of them under the lock kept for the rename */
+	if ((d = data_open(c->fn, c->backup, conf)) == NULL)
+		goto fail;
+	locked = c->keys;
+	if (compact_replay(c, d, 0))
+		goto faild;
+	if (debug > 0)
+		printf("%s: %u records, %u keys changed since copied, %u "
+		    "under lock\n", c->name, c->count, c->keys,
+		    c->keys - locked);
+	if (!c->backup && put_format(c->db2)) {
+		fprintf(stderr, "%s: db->put: %s\n", c->name, strerror(errno));
+		goto faild;
+	}
+	r = c->db2->close(c->db2);
+	c->db2 = NULL;
+	if (r) {
+		fprintf(stderr, "%s: dbclose: %s: %s\n", c->name, c->tmp,
+		    strerror(errno));
+		goto faild;
+	}
+	/* as they are with the database, a partial value of a journal aside */
+	if (c->backup) {
+		snprintf(tn, sizeof(tn), "%s.last", to);
+		if (copy_file(d->lt.fn, tn, 0))
+			goto faild;
+		snprintf(tn, sizeof(tn), "%s.journal", to);
+		if (copy_file(d->jfn, tn, 0))
+			goto faild;
+		snprintf(tn, sizeof(tn), "%s.changes", to);
+		if (copy_file(d->chfn, tn, 0))
+			goto faild;
+	}
+	if (rename(c->tmp, to)) {
+		fprintf(stderr, "%s: rename: %s: %s\n", c->name, c->tmp,
+		    strerror(errno));
+		goto faild;
+	}
+	/* writers waiting for the lock reopen the new file, without log */
+	unlink(c->kfn);
+	close(c->kfd);
+	last_close(&c->lt);
+	data_close(d);
+	return (0);
+
+faild:
+	data_close(d);
+fail:
+	if (c->db2 != NULL)
+		c->db2->close(c->db2);
+	unlink(c->tmp);
+	unlink(c->kfn);
+	close(c->kfd);
+	last_close(&c->lt);
+	return (1);
+}
+
+/*
+ * Back up the database with its table of last values, journal and log
+ * of changes.  The database is copied like by data_compact(), as it is
+ * and under a shared lock only for the last few changes made meanwhile
+ * and the other files, so values can still be stored during most of
+ * the copy.  Shards are copied one at a time.
+ */
+int
+data_backup(const char *filename, const char *to,
+    const struct data_conf *conf)
+{
+	char fn[1024], tn[1024];
+	struct data_conf sc;
+	struct compact c;
+	unsigned i;
+	int r = 0;
+
+	if (conf->shards > 1) {
+		sc = *conf;
+		sc.units = conf->units / conf->shards + 1;
+		sc.shards = 0;
+		sc.changes = 0;
+		for (i = 0; i < conf->shards; ++i) {
+			snprintf(fn, sizeof(fn), "%s.%u", filename, i);
+			snprintf(tn, sizeof(tn), "%s.%u", to, i);
+			if (!access(fn, F_OK) && data_backup(fn, tn, &sc))
+				r = 1;
+		}
+		snprintf(fn, sizeof(fn), "%s.changes", filename);
+		snprintf(tn, sizeof(tn), "%s.changes", to);
+		if (copy_file(fn, tn, 0))
+			r = 1;
+		return (r);
+	}
+	if (debug > 0)
+		printf("data_backup: copying %s to %s\n", filename, to);
+	memset(&c, 0, sizeof(c));
+	c.name = "data_backup";
+	c.fn = filename;
+	c.backup = 1;
+	snprintf(c.tmp, sizeof(c.tmp), "%s.tmp", to);
+	snprintf(c.kfn, sizeof(c.kfn), "%s.compact.keys", filename);
+	return (compact_run(&c, to, conf));
+}
+
+/*
+ * Compact the database into a new file, then replace it, see
+ * compact_run().  With drop, records of levels no longer rolled up
+ * into are left out.
+ */
+int
+data_compact(const char *filename, int drop, const struct data_conf *conf)
+{
+	char tmp[1024];
+	struct data_conf sc;
+	struct compact c;
+	unsigned i;
+	int r;
+
+	/* one shard at a time, the others stay available */
+	if (conf->shards > 1) {
+		sc = *conf;
+		sc.units = conf->units / conf->shards + 1;
+		sc.shards = 0;
+		sc.changes = 0;
+		for (i = r = 0; i < conf->shards; ++i) {
+			snprintf(tmp, sizeof(tmp), "%s.%u", filename, i);
+			if (!access(tmp, F_OK) && data_compact(tmp, drop, &sc))
+				r = 1;
+		}
+		return (r);
+	}
+	memset(&c, 0, sizeof(c));
+	c.name = "data_compact";
+	c.fn = filename;
+	c.drop = drop;
+	snprintf(c.tmp, sizeof(c.tmp), "%s.compact", filename);
+	snprintf(c.kfn, sizeof(c.kfn), "%s.compact.keys", filename);
+	if (debug > 0)
+		printf("data_compact: creating %s\n", c.tmp);
+	return (compact_run(&c, filename, conf));
+}
@@ -37,14 +37,84 @@
 #define DATA_TYPE_MIN	1
 #define DATA_TYPE_AVG	2
 #define DATA_TYPE_MAX	3
+#define DATA_TYPE_PERCENTILE(p)	(100 + (p))
+#define DATA_TYPE_IS_PERCENTILE(t)	((t) > 100 && (t) < 200)
 
-int	 data_open(const char *filename);
-int	 data_close();
-int	 data_put_value(unsigned since, unsigned ts, unsigned short unit,
-	    double val, int tdiff, int vdiff);
-int	 data_get_values(unsigned short unit, unsigned beg, unsigned end,
-	    int type, unsigned siz, double *a, int console);
-int	 data_truncate(unsigned days_detail, unsigned days_compressed);
-int	 data_copy(const char *filename);
+#define DATA_TDIFF	0x01	/* store change per second */
+#define DATA_VDIFF	0x02	/* store change */
+#define DATA_SKETCH	0x04	/* keep quantile sketches in rollups */
+
+#define DATA_SYNC_NEVER	-1
+#define DATA_SYNC_TICK	0
+
+#define DATA_NAME_MAX	128	/* length of a series name */
+#define DATA_UNIT_MAX	0xffff	/* of a numbered series, names above */
+
+struct data;
+
+struct data_conf {
+	unsigned	 units;		/* collects and graphs in use */
+	unsigned	 psize;		/* page size of a new file */
+	unsigned	 cachesize;
+	unsigned	 shards;	/* files the units are spread over */
+	unsigned	 range;		/* units per shard, 0 to hash */
+	unsigned	 gap;		/* seconds a value holds, 0 for ever */
+	unsigned	 changes;	/* create a log of changes */
+	unsigned	 snapshot;	/* start the snapshot index */
+};
+
+/* values within a range, see data_get_summary() */
+struct data_summary {
+	double		 min;
+	double		 avg;
+	double		 max;
+	double		 count;
+	double		 sum;
+	double		 sumsq;
+};
+
+/*
+ * The value of a unit at a point in time, or over a range up to it,
+ * see data_get_snapshot() and data_get_top().
+ */
+struct data_point {
+	unsigned	 unit;
+	unsigned	 ts;
+	double		 val;
+	const char	*name;		/* of a series, or NULL */
+};
+
+struct data	*data_open(const char *filename, int rdonly,
+		    const struct data_conf *);
+int	 data_close(struct data *);
+int	 data_series(struct data *, const char *name, unsigned *unit,
+	    int create);
+int	 data_put_value(struct data *, unsigned since, unsigned ts,
+	    unsigned unit, double val, int flags);
+int	 data_batch_begin(struct data *);
+int	 data_batch_commit(struct data *);
+void	 data_sync_policy(struct data *, int sync);
+int	 data_journal_open(struct data *, int flush);
+int	 data_journal_close(struct data *);
+int	 data_get_values(struct data *, unsigned unit, unsigned beg,
+	    unsigned end, int type, unsigned siz, double *a, int console);
+int	 data_get_summary(struct data *, unsigned unit, unsigned beg,
+	    unsigned end, struct data_summary *);
+int	 data_get_snapshot(struct data *, unsigned beg, unsigned end,
+	    struct data_point **, unsigned *);
+int	 data_get_top(struct data *, int type, unsigned k, unsigned beg,
+	    unsigned end, struct data_point **, unsigned *);
+int	 data_cache_open(struct data *, const char *filename);
+int	 data_cache_close(struct data *);
+int	 data_truncate(struct data *, unsigned days_detail,
+	    unsigned days_compressed);
+int	 data_rebuild(struct data *, int (*flags)(unsigned unit));
+int	 data_stats(struct data *);
+int	 data_export(struct data *, unsigned long long seq, FILE *);
+int	 data_copy(struct data *, const char *filename);
+int	 data_backup(const char *filename, const char *to,
+	    const struct data_conf *);
+int	 data_compact(const char *filename, int drop,
+	    const struct data_conf *);
 
 #endif
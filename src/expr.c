@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2025, Nikola Kolev <koue@chaosophia.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "data.h"
+#include "expr.h"
+
+enum {
+	EXPR_REF, EXPR_NUM, EXPR_NEG, EXPR_ADD, EXPR_SUB, EXPR_MUL,
+	EXPR_DIV, EXPR_SUM, EXPR_RATE, EXPR_RATIO
+};
+
+static const struct {
+	const char	*name;
+	int		 op;
+	unsigned	 args;	/* 0 for any number */
+} funcs[] = {
+	{ "rate",	EXPR_RATE,	1 },
+	{ "ratio",	EXPR_RATIO,	2 },
+	{ "scale",	EXPR_MUL,	2 },
+	{ "sum",	EXPR_SUM,	0 },
+};
+
+struct parser {
+	struct pool	*pool;
+	const char	*s;
+	struct expr	*e;
+	unsigned	 sp;
+};
+
+static int	 parse_sum(struct parser *);
+
+static void
+skip_space(struct parser *p)
+{
+	while (isspace((unsigned char)*p->s))
+		p->s++;
+}
+
+static int
+syntax(struct parser *p, const char *msg)
+{
+	fprintf(stderr, "expr_parse: %s at \"%s\"\n", msg, p->s);
+	return (1);
+}
+
+/* append an operation, keeping track of the depth of the stack */
+static void
+emit(struct parser *p, int op, unsigned arg, double val)
+{
+	struct expr *e = p->e;
+
+	e->op[e->nop].op = op;
+	e->op[e->nop].arg = arg;
+	e->op[e->nop++].val = val;
+	switch (op) {
+	case EXPR_REF:
+	case EXPR_NUM:
+		p->sp++;
+		break;
+	case EXPR_NEG:
+	case EXPR_RATE:
+		break;
+	case EXPR_SUM:
+		p->sp -= arg - 1;
+		break;
+	default:
+		p->sp--;
+	}
+	if (p->sp > e->depth)
+		e->depth = p->sp;
+}
+
+static int
+parse_ref(struct parser *p, unsigned unit, const char *name, size_t len)
+{
+	struct expr *e = p->e;
+	unsigned i;
+
+	for (i = 0; i < e->nref; ++i)
+		if (name == NULL ? e->ref[i].name == NULL &&
+		    e->ref[i].unit == unit : e->ref[i].name != NULL &&
+		    strlen(e->ref[i].name) == len &&
+		    !strncmp(e->ref[i].name, name, len))
+			break;
+	if (i == e->nref) {
+		e->ref[i].unit = unit;
+		e->ref[i].a = NULL;
+		e->ref[i].name = NULL;
+		if (name != NULL) {
+			if ((e->ref[i].name = pool_alloc(p->pool,
+			    len + 1)) == NULL) {
+				fprintf(stderr, "expr_parse: pool_alloc: %s\n",
+				    strerror(errno));
+				return (1);
+			}
+			memcpy(e->ref[i].name, name, len);
+			e->ref[i].name[len] = 0;
+		}
+		e->nref++;
+	}
+	emit(p, EXPR_REF, i, 0.0);
+	return (0);
+}
+
+static int
+parse_func(struct parser *p, const char *name, size_t len)
+{
+	unsigned i, n = 0;
+
+	for (i = 0; i < sizeof(funcs) / sizeof(funcs[0]); ++i)
+		if (strlen(funcs[i].name) == len &&
+		    !strncmp(funcs[i].name, name, len))
+			break;
+	if (i == sizeof(funcs) / sizeof(funcs[0]))
+		return (syntax(p, "unknown function"));
+	p->s++;
+	do {
+		if (n++)
+			p->s++;
+		if (parse_sum(p))
+			return (1);
+		skip_space(p);
+	} while (*p->s == ',');
+	if (*p->s != ')')
+		return (syntax(p, "expected )"));
+	p->s++;
+	if (funcs[i].args && n != funcs[i].args)
+		return (syntax(p, "wrong number of arguments"));
+	emit(p, funcs[i].op, n, 0.0);
+	return (0);
+}
+
+/* number, uN, [name], function(...), (...) or a negation of those */
+static int
+parse_unary(struct parser *p)
+{
+	const char *q;
+	unsigned long nr;
+	double val;
+	char *end;
+
+	skip_space(p);
+	if (*p->s == '-') {
+		p->s++;
+		if (parse_unary(p))
+			return (1);
+		emit(p, EXPR_NEG, 0, 0.0);
+		return (0);
+	}
+	if (*p->s == '(') {
+		p->s++;
+		if (parse_sum(p))
+			return (1);
+		skip_space(p);
+		if (*p->s != ')')
+			return (syntax(p, "expected )"));
+		p->s++;
+		return (0);
+	}
+	if (*p->s == '[') {
+		q = ++p->s;
+		while (*p->s && *p->s != ']')
+			p->s++;
+		if (*p->s != ']' || p->s == q)
+			return (syntax(p, "expected series name"));
+		p->s++;
+		return (parse_ref(p, 0, q, p->s - 1 - q));
+	}
+	if (*p->s == 'u' && isdigit((unsigned char)p->s[1])) {
+		nr = strtoul(p->s + 1, &end, 10);
+		if (nr == 0 || nr > DATA_UNIT_MAX)
+			return (syntax(p, "invalid unit"));
+		p->s = end;
+		return (parse_ref(p, nr, NULL, 0));
+	}
+	if (isalpha((unsigned char)*p->s)) {
+		q = p->s;
+		while (isalpha((unsigned char)*p->s))
+			p->s++;
+		skip_space(p);
+		if (*p->s != '(')
+			return (syntax(p, "expected ("));
+		return (parse_func(p, q, p->s - q));
+	}
+	val = strtod(p->s, &end);
+	if (end == p->s)
+		return (syntax(p, "expected operand"));
+	p->s = end;
+	emit(p, EXPR_NUM, 0, val);
+	return (0);
+}
+
+static int
+parse_product(struct parser *p)
+{
+	char c;
+
+	if (parse_unary(p))
+		return (1);
+	for (;;) {
+		skip_space(p);
+		if ((c = *p->s) != '*' && c != '/')
+			return (0);
+		p->s++;
+		if (parse_unary(p))
+			return (1);
+		emit(p, c == '*' ? EXPR_MUL : EXPR_DIV, 0, 0.0);
+	}
+}
+
+static int
+parse_sum(struct parser *p)
+{
+	char c;
+
+	if (parse_product(p))
+		return (1);
+	for (;;) {
+		skip_space(p);
+		if ((c = *p->s) != '+' && c != '-')
+			return (0);
+		p->s++;
+		if (parse_product(p))
+			return (1);
+		emit(p, c == '+' ? EXPR_ADD : EXPR_SUB, 0, 0.0);
+	}
+}
+
+/*
+ * Compile an expression of units (u60), series names ([name]),
+ * numbers, + - * / and the functions sum(), rate(), ratio() and
+ * scale().  Each token yields at most one operation or reference.
+ */
+struct expr *
+expr_parse(struct pool *pool, const char *s)
+{
+	struct parser p;
+	size_t len = strlen(s) + 1;
+
+	memset(&p, 0, sizeof(p));
+	p.pool = pool;
+	p.s = s;
+	if ((p.e = pool_alloc(pool, sizeof(*p.e))) == NULL ||
+	    (p.e->op = pool_alloc(pool, len * sizeof(*p.e->op))) == NULL ||
+	    (p.e->ref = pool_alloc(pool, len * sizeof(*p.e->ref))) == NULL) {
+		fprintf(stderr, "expr_parse: pool_alloc: %s\n",
+		    strerror(errno));
+		return (NULL);
+	}
+	p.e->nop = p.e->nref = p.e->depth = 0;
+	if (parse_sum(&p))
+		return (NULL);
+	skip_space(&p);
+	if (*p.s) {
+		syntax(&p, "unexpected character");
+		return (NULL);
+	}
+	return (p.e);
+}
+
+/*
+ * Evaluate an expression over the n values of its references, step
+ * seconds apart, into out.  Each operation is a single loop over the
+ * arrays on top of the stack.  Missing values propagate, except that
+ * sum() adds up those present, and a division by zero is missing.
+ */
+int
+expr_eval(const struct expr *e, unsigned n, double step, double *out)
+{
+	const struct expr_op *o;
+	double *stack, *x, *y;
+	unsigned i, j, k, sp = 0;
+
+	if ((stack = calloc((size_t)e->depth * n, sizeof(double))) == NULL) {
+		fprintf(stderr, "expr_eval: calloc: %s\n", strerror(errno));
+		return (1);
+	}
+	for (i = 0; i < e->nop; ++i) {
+		o = &e->op[i];
+		x = stack + (size_t)sp * n;	/* next free */
+		y = x - n;			/* top */
+		switch (o->op) {
+		case EXPR_REF:
+			memcpy(x, e->ref[o->arg].a, n * sizeof(double));
+			sp++;
+			break;
+		case EXPR_NUM:
+			for (j = 0; j < n; ++j)
+				x[j] = o->val;
+			sp++;
+			break;
+		case EXPR_NEG:
+			for (j = 0; j < n; ++j)
+				y[j] = -y[j];
+			break;
+		case EXPR_RATE:
+			for (j = n - 1; j > 0; --j)
+				y[j] = (y[j] - y[j - 1]) / step;
+			if (n)
+				y[0] = NAN;
+			break;
+		case EXPR_SUM:
+			x = stack + (size_t)(sp - o->arg) * n;
+			for (k = 1; k < o->arg; ++k) {
+				y = x + (size_t)k * n;
+				for (j = 0; j < n; ++j)
+					if (isnan(x[j]))
+						x[j] = y[j];
+					else if (!isnan(y[j]))
+						x[j] += y[j];
+			}
+			sp -= o->arg - 1;
+			break;
+		default:
+			x = y - n;
+			switch (o->op) {
+			case EXPR_ADD:
+				for (j = 0; j < n; ++j)
+					x[j] += y[j];
+				break;
+			case EXPR_SUB:
+				for (j = 0; j < n; ++j)
+					x[j] -= y[j];
+				break;
+			case EXPR_MUL:
+				for (j = 0; j < n; ++j)
+					x[j] *= y[j];
+				break;
+			case EXPR_DIV:
+				for (j = 0; j < n; ++j)
+					x[j] = y[j] != 0.0 ? x[j] / y[j] : NAN;
+				break;
+			case EXPR_RATIO:
+				for (j = 0; j < n; ++j)
+					x[j] = y[j] != 0.0 ?
+					    100.0 * x[j] / y[j] : NAN;
+				break;
+			}
+			sp--;
+		}
+	}
+	memcpy(out, stack, n * sizeof(double));
+	free(stack);
+	return (0);
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2025, Nikola Kolev <koue@chaosophia.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _EXPR_H_
+#define _EXPR_H_
+
+/*
+ * Derived series: an expression over the values of other series,
+ * compiled to reverse polish notation and evaluated over whole arrays
+ * of values at a time, one operation after the other.
+ */
+struct expr_ref {
+	unsigned	 unit;
+	char		*name;	/* series name, unit looked up later */
+	double		*a;	/* its values, filled by the caller */
+};
+
+struct expr_op {
+	int		 op;
+	unsigned	 arg;	/* reference, or number of sum() operands */
+	double		 val;	/* constant */
+};
+
+struct expr {
+	struct expr_op	*op;
+	unsigned	 nop;
+	struct expr_ref	*ref;
+	unsigned	 nref;
+	unsigned	 depth;	/* of the stack of arrays */
+};
+
+struct expr	*expr_parse(struct pool *, const char *);
+int		 expr_eval(const struct expr *, unsigned, double, double *);
+
+#endif
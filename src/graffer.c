@@ -34,19 +34,24 @@
 #include <netinet/in.h>
 #include <net/if.h>
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "pool.h"
 #include "data.h"
 #include "graph.h"
+#include "expr.h"
 
 extern int	 parse_config(const char *, struct matrix **);
 
@@ -54,26 +59,72 @@ struct pool *pool;
 
 struct col {
 	unsigned	 nr;
+	const char	*name;	/* series name, nr looked up later */
 	char		 arg[128];
-	int		 tdiff;
-	int		 vdiff;
+	int		 flags;
 	double		 val;
+	unsigned	 lo, hi;	/* units of an aggregate, or 0 */
+	int		 type;		/* DATA_TYPE_* of it, 0 for a sum */
 } cols[512];
 
 unsigned maxcol = 0;
 unsigned since = 0;
+unsigned cachesize = 0, pagesize = 0;
+unsigned shards = 0, shardrange = 0;
+int syncpolicy = DATA_SYNC_TICK;
+int journal = 0;
+int changes = 0;
+int snapshot = 0;
+unsigned gap = 0;
 int debug = 0;
 
+/* databases of other hosts, given as -d host=database, read-only */
+struct host {
+	const char	*name;
+	const char	*fn;
+	struct data	*data;
+} hosts[32];
+
+unsigned nhosts = 0;
+
+/* values of a graph to fetch from a database */
+struct fetch {
+	struct data	*data;
+	unsigned	 unit;
+	struct matrix	*m;
+	struct graph	*g;
+	double		*a;	/* g->data, or summed into it after */
+	struct expr_ref	*ref;	/* or an operand of g->expr */
+};
+
+/* a thread fetching the values of one database */
+struct fetcher {
+	struct data	*data;
+	struct fetch	*f;
+	unsigned	 nf;
+	pthread_t	 thread;
+	int		 r;
+};
+
 int
-add_col(unsigned nr, const char *arg, int tdiff, int vdiff)
+add_col(unsigned nr, const char *name, const char *arg, int flags)
 {
 	int i;
 
+	if (name == NULL && (nr == 0 || nr > DATA_UNIT_MAX)) {
+		fprintf(stderr, "add_col: invalid number %u\n", nr);
+		return (1);
+	}
 	for (i = 0; i < maxcol; ++i) {
-		if (cols[i].nr == nr) {
+		if (name == NULL && cols[i].nr == nr) {
 			fprintf(stderr, "add_col: %d already defined\n", nr);
 			return (1);
 		}
+		if (name != NULL && cols[i].name != NULL &&
+		    !strcmp(cols[i].name, name)) {
+			fprintf(stderr, "add_col: %s already defined\n", name);
+			return (1);
+		}
 	}
 	if (maxcol == sizeof(cols) / sizeof(cols[0])) {
 		fprintf(stderr, "add_col: limit of %d collects reached\n",
@@ -81,17 +132,31 @@ add_col(unsigned nr, const char *arg, int tdiff, int vdiff)
 		return (1);
 	}
 	cols[maxcol].nr = nr;
+	cols[maxcol].name = name;
 	strlcpy(cols[maxcol].arg, arg, sizeof(cols[maxcol].arg));
-	cols[maxcol].tdiff = tdiff;
-	cols[maxcol].vdiff = vdiff;
+	cols[maxcol].flags = flags;
 	maxcol++;
 	return (0);
 }
 
+/* a collect of the values collected of the units lo to hi */
+int
+add_aggregate(unsigned nr, const char *name, int type, unsigned lo,
+    unsigned hi, int flags)
+{
+	if (add_col(nr, name, "", flags))
+		return (1);
+	cols[maxcol - 1].lo = lo;
+	cols[maxcol - 1].hi = hi;
+	cols[maxcol - 1].type = type;
+	return (0);
+}
+
 double
 value_query(const char *arg)
 {
 	char query_path[256], result[256], *end;
+	double val;
 	FILE *fp;
 
 	if(debug)
@@ -100,10 +165,311 @@ value_query(const char *arg)
 	if(debug)
 		printf("value_query - query_path [%s]\n", query_path);
 	if ((fp = popen(query_path, "r")) == NULL)
-		return 0;
-	fgets(result, sizeof(result), fp);
+		return (NAN);
+	/* a failed collect is stored as a gap */
+	if (fgets(result, sizeof(result), fp) == NULL) {
+		pclose(fp);
+		return (NAN);
+	}
 	pclose(fp);
-	return strtod(result, &end);
+	val = strtod(result, &end);
+	return (end == result ? NAN : val);
+}
+
+static struct host *
+find_host(const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < nhosts; ++i)
+		if (!strcmp(hosts[i].name, name))
+			return (&hosts[i]);
+	return (NULL);
+}
+
+static int
+add_host(const char *arg)
+{
+	const char *p = strchr(arg, '=');
+	char *name;
+
+	if (nhosts == sizeof(hosts) / sizeof(hosts[0])) {
+		fprintf(stderr, "add_host: limit of %u hosts reached\n",
+		    nhosts);
+		return (1);
+	}
+	if ((name = pool_strdup(pool, arg)) == NULL) {
+		fprintf(stderr, "add_host: pool_strdup: %s\n",
+		    strerror(errno));
+		return (1);
+	}
+	name[p - arg] = 0;
+	if (!*name || !strcmp(name, "*") || find_host(name) != NULL ||
+	    !p[1]) {
+		fprintf(stderr, "add_host: invalid host %s\n", arg);
+		return (1);
+	}
+	hosts[nhosts].name = name;
+	hosts[nhosts].fn = p + 1;
+	nhosts++;
+	return (0);
+}
+
+static void
+close_hosts(void)
+{
+	unsigned i;
+
+	for (i = 0; i < nhosts; ++i)
+		if (hosts[i].data != NULL) {
+			data_close(hosts[i].data);
+			hosts[i].data = NULL;
+		}
+}
+
+/*
+ * Split the series "host:number" or "host:name" of a graph into the
+ * host, given with -d or * for all of them, and the number or name.
+ * Other series names may contain colons as well.
+ */
+static int
+split_host(struct graph *g)
+{
+	char *p, *q;
+	unsigned long nr;
+
+	if ((p = strchr(g->name, ':')) == NULL)
+		return (0);
+	*p = 0;
+	if (strcmp(g->name, "*") && find_host(g->name) == NULL) {
+		*p = ':';
+		return (0);
+	}
+	g->host = g->name;
+	g->name = p + 1;
+	nr = strtoul(g->name, &q, 10);
+	if (q == g->name || *q != 0)
+		return (0);
+	if (nr == 0 || nr > DATA_UNIT_MAX) {
+		fprintf(stderr, "split_host: invalid number %s:%s\n",
+		    g->host, g->name);
+		return (1);
+	}
+	g->desc_nr = nr;
+	g->name = NULL;
+	return (0);
+}
+
+/*
+ * Look up the units of the collects and graphs given by series name,
+ * checking that no two collects end up with the same unit, as they
+ * would with a catalog not created by this version.  Only collects
+ * add new names; graphs are looked up of the image only, if given.
+ * A series not in the catalog yet, as one only pushed with -i before
+ * its first value, is left at unit 0 and drawn blank, but fails -g.
+ */
+static int
+resolve_names(struct data *data, struct matrix *matrices, const char *only)
+{
+	struct matrix *m;
+	struct graph *g;
+	unsigned j;
+	int i;
+
+	for (i = 0; i < maxcol; ++i)
+		if (cols[i].name != NULL &&
+		    data_series(data, cols[i].name, &cols[i].nr, 1))
+			return (1);
+	for (i = 0; i < maxcol; ++i)
+		for (j = i + 1; j < maxcol; ++j)
+			if (cols[i].nr == cols[j].nr) {
+				fprintf(stderr, "resolve_names: series %s has "
+				    "the unit %u of another collect\n",
+				    cols[j].name != NULL ? cols[j].name :
+				    cols[i].name, cols[i].nr);
+				return (1);
+			}
+	for (m = matrices; m != NULL; m = m->next)
+		for (i = 0; i < 2; ++i)
+			for (g = m->graphs[i]; g != NULL; g = g->next) {
+				if (only != NULL && strcmp(m->filename, only))
+					break;
+				for (j = 0; g->expr != NULL &&
+				    j < g->expr->nref; ++j)
+					if (g->expr->ref[j].name != NULL &&
+					    data_series(data,
+					    g->expr->ref[j].name,
+					    &g->expr->ref[j].unit, 0))
+						g->expr->ref[j].unit = 0;
+				if (g->name == NULL)
+					continue;
+				if (nhosts && split_host(g))
+					return (1);
+				/* of all hosts, looked up in each */
+				if (g->name == NULL || (g->host != NULL &&
+				    !strcmp(g->host, "*")))
+					continue;
+				if (data_series(g->host != NULL ?
+				    find_host(g->host)->data : data, g->name,
+				    &g->desc_nr, 0)) {
+					if (only != NULL)
+						return (1);
+					g->desc_nr = 0;
+				}
+			}
+	return (0);
+}
+
+static void *
+fetch_thread(void *arg)
+{
+	struct fetcher *t = arg;
+	struct fetch *f;
+	unsigned i, p;
+
+	for (i = 0; i < t->nf; ++i) {
+		f = &t->f[i];
+		if (f->data != t->data)
+			continue;
+		/* a series not in the catalog, see resolve_names() */
+		if (f->unit == 0) {
+			for (p = 0; p < f->m->w0; ++p)
+				f->a[p] = NAN;
+			continue;
+		}
+		if (debug)
+			printf("fetching values for unit %u from database\n",
+			    f->unit);
+		if (data_get_values(f->data, f->unit, f->m->beg, f->m->end,
+		    f->g->type, f->m->w0, f->a, 0)) {
+			fprintf(stderr, "main: data_get_values() failed\n");
+			t->r = 1;
+			break;
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Fetch the values of the graphs, those of each host by a thread of
+ * its own, and sum the values of a series of all hosts, where at least
+ * one has a value.  Graphs of an expression get the values of its
+ * operands, then evaluate it.
+ */
+static int
+fetch_values(struct data *data, struct matrix *matrices)
+{
+	struct fetcher t[1 + sizeof(hosts) / sizeof(hosts[0])];
+	struct fetch *f;
+	struct matrix *m;
+	struct graph *g;
+	unsigned n = 0, nf = 0, j, k, p;
+	int i, r = 0;
+
+	for (m = matrices; m != NULL; m = m->next)
+		for (i = 0; i < 2; ++i)
+			for (g = m->graphs[i]; g != NULL; g = g->next)
+				n += g->expr != NULL ? g->expr->nref :
+				    1 + nhosts;
+	if ((f = calloc(n ? n : 1, sizeof(*f))) == NULL) {
+		fprintf(stderr, "main: calloc: %s\n", strerror(errno));
+		return (1);
+	}
+	for (m = matrices; m != NULL; m = m->next)
+		for (i = 0; i < 2; ++i)
+			for (g = m->graphs[i]; g != NULL; g = g->next) {
+				for (j = 0; g->expr != NULL &&
+				    j < g->expr->nref; ++j) {
+					f[nf].a = calloc(m->w0, sizeof(double));
+					if (f[nf].a == NULL) {
+						fprintf(stderr, "main: calloc: "
+						    "%s\n", strerror(errno));
+						r = 1;
+						goto done;
+					}
+					f[nf].ref = &g->expr->ref[j];
+					f[nf].ref->a = f[nf].a;
+					f[nf].data = data;
+					f[nf].unit = f[nf].ref->unit;
+					f[nf].m = m;
+					f[nf++].g = g;
+				}
+				if (g->expr != NULL)
+					continue;
+				if (g->host == NULL || strcmp(g->host, "*")) {
+					f[nf].data = g->host == NULL ? data :
+					    find_host(g->host)->data;
+					f[nf].unit = g->desc_nr;
+					f[nf].m = m;
+					f[nf].g = g;
+					f[nf++].a = g->data;
+					continue;
+				}
+				for (p = 0; p < m->w0; ++p)
+					g->data[p] = NAN;
+				for (j = 0; j < nhosts; ++j) {
+					f[nf].unit = g->desc_nr;
+					if (g->name != NULL &&
+					    data_series(hosts[j].data, g->name,
+					    &f[nf].unit, 0))
+						continue;
+					f[nf].a = calloc(m->w0, sizeof(double));
+					if (f[nf].a == NULL) {
+						fprintf(stderr, "main: calloc: "
+						    "%s\n", strerror(errno));
+						r = 1;
+						goto done;
+					}
+					f[nf].data = hosts[j].data;
+					f[nf].m = m;
+					f[nf++].g = g;
+				}
+			}
+
+	memset(t, 0, sizeof(t));
+	for (j = 0; j <= nhosts; ++j) {
+		t[j].data = j ? hosts[j - 1].data : data;
+		t[j].f = f;
+		t[j].nf = nf;
+	}
+	for (j = 1; j <= nhosts; ++j)
+		if ((errno = pthread_create(&t[j].thread, NULL, fetch_thread,
+		    &t[j]))) {
+			fprintf(stderr, "main: pthread_create: %s\n",
+			    strerror(errno));
+			fetch_thread(&t[j]);
+			t[j].data = NULL;
+		}
+	fetch_thread(&t[0]);
+	for (j = 0; j <= nhosts; ++j) {
+		if (j && t[j].data != NULL)
+			pthread_join(t[j].thread, NULL);
+		if (t[j].r)
+			r = 1;
+	}
+
+	for (k = 0; k < nf; ++k) {
+		if (f[k].a == f[k].g->data || f[k].ref != NULL)
+			continue;
+		for (p = 0; p < f[k].m->w0; ++p)
+			if (isnan(f[k].g->data[p]))
+				f[k].g->data[p] = f[k].a[p];
+			else if (!isnan(f[k].a[p]))
+				f[k].g->data[p] += f[k].a[p];
+	}
+	for (m = matrices; r == 0 && m != NULL; m = m->next)
+		for (i = 0; i < 2; ++i)
+			for (g = m->graphs[i]; g != NULL; g = g->next)
+				if (g->expr != NULL && expr_eval(g->expr,
+				    m->w0, (double)(m->end - m->beg) / m->w0,
+				    g->data))
+					r = 1;
+done:
+	for (k = 0; k < nf; ++k)
+		if (f[k].a != f[k].g->data)
+			free(f[k].a);
+	free(f);
+	return (r);
 }
 
 static void
@@ -117,14 +483,237 @@ set_col(unsigned nr, double val)
 	}
 }
 
+/*
+ * Compute the aggregates from the values just collected of the other
+ * collects in their range, leaving out gaps.  An aggregate of gaps
+ * only is a gap as well, and so is one of counters with any gap, as
+ * their sum would drop and rise again by the whole missing counter.
+ */
+static void
+aggregate(void)
+{
+	unsigned i, j, n;
+	double val;
+
+	for (i = 0; i < maxcol; ++i) {
+		if (!cols[i].hi)
+			continue;
+		val = NAN;
+		n = 0;
+		for (j = 0; j < maxcol; ++j) {
+			if (cols[j].hi || cols[j].nr < cols[i].lo ||
+			    cols[j].nr > cols[i].hi)
+				continue;
+			if (isnan(cols[j].val)) {
+				if (!(cols[i].flags & (DATA_TDIFF|DATA_VDIFF)))
+					continue;
+				val = NAN;
+				n = 0;
+				break;
+			}
+			if (n++ == 0)
+				val = cols[j].val;
+			else if (cols[i].type == DATA_TYPE_MIN)
+				val = fmin(val, cols[j].val);
+			else if (cols[i].type == DATA_TYPE_MAX)
+				val = fmax(val, cols[j].val);
+			else
+				val += cols[j].val;
+		}
+		if (n && cols[i].type == DATA_TYPE_AVG)
+			val /= n;
+		if (debug)
+			printf("aggregate %u of %u values: %lf\n", cols[i].nr,
+			    n, val);
+		cols[i].val = val;
+	}
+}
+
+/* flags of the collect of unit for data_rebuild(), -1 if there is none */
+static int
+col_flags(unsigned unit)
+{
+	int i;
+
+	for (i = 0; i < maxcol; ++i)
+		if (cols[i].nr == unit)
+			return (cols[i].flags);
+	return (-1);
+}
+
+/*
+ * Store values pushed on stdin, one "number value [timestamp]" per line,
+ * or with a series name instead of the number.  An empty line ends a
+ * batch, which is committed as a whole.
+ */
+static int
+ingest(struct data *data)
+{
+	char line[256], *p, *q;
+	unsigned long nr, ts;
+	unsigned lineno = 0, unit;
+	size_t len;
+	double val;
+	int i, r = 0;
+
+	if (data_batch_begin(data))
+		return (1);
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		lineno++;
+		p = line + strspn(line, " \t");
+		if (*p == '\n' || *p == 0) {
+			if (data_batch_commit(data) || data_batch_begin(data))
+				r = 1;
+			continue;
+		}
+		len = strcspn(p, " \t\n");
+		nr = strtoul(p, &q, 10);
+		if (q != p + len) {
+			if (p[len] == 0)
+				goto bad;
+			p[len] = 0;
+			if (data_series(data, p, &unit, 1)) {
+				r = 1;
+				continue;
+			}
+			nr = unit;
+			q = p + len + 1;
+		} else if (nr == 0 || nr > DATA_UNIT_MAX)
+			goto bad;
+		p = q;
+		val = strtod(p, &q);
+		if (q == p)
+			goto bad;
+		p = q;
+		ts = strtoul(p, &q, 10);
+		if (q == p)
+			ts = time(NULL);
+		p = q + strspn(q, " \t\n");
+		if (*p != 0)
+			goto bad;
+		for (i = 0; i < maxcol; ++i)
+			if (cols[i].nr == nr)
+				break;
+		if (data_put_value(data, since, ts, nr, val,
+		    i < maxcol ? cols[i].flags : 0))
+			r = 1;
+		continue;
+bad:
+		fprintf(stderr, "ingest: line %u: invalid value\n", lineno);
+		r = 1;
+	}
+	if (data_batch_commit(data))
+		r = 1;
+	return (r);
+}
+
+/*
+ * Apply changes exported by another database with -e, one "seq since
+ * ts flags value unit [name]" per line, in one batch per 1024 lines.
+ * The sequence number of the last one is printed, for the next export.
+ */
+static int
+import(struct data *data, const char *fn)
+{
+	char line[256], *p, *q;
+	unsigned long long seq, last = 0;
+	unsigned long since, ts, unit, lineno = 0;
+	unsigned nr;
+	double val;
+	long flags;
+	FILE *fp;
+	int r = 0;
+
+	if (!strcmp(fn, "-"))
+		fp = stdin;
+	else if ((fp = fopen(fn, "r")) == NULL) {
+		fprintf(stderr, "import: %s: %s\n", fn, strerror(errno));
+		return (1);
+	}
+	if (data_batch_begin(data))
+		r = 1;
+	while (!r && fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		seq = strtoull(line, &p, 10);
+		since = strtoul(p, &q, 10);
+		ts = strtoul(q, &p, 10);
+		flags = strtol(p, &q, 10);
+		val = strtod(q, &p);
+		unit = strtoul(p, &q, 10);
+		if (q == p || seq <= last || since > 0xffffffffUL ||
+		    ts > 0xffffffffUL || unit == 0 || unit >= 0xffffffffUL ||
+		    (flags & ~(DATA_TDIFF|DATA_VDIFF|DATA_SKETCH))) {
+			fprintf(stderr, "import: %s: line %lu: invalid "
+			    "change\n", fn, lineno);
+			r = 1;
+			break;
+		}
+		nr = unit;
+		p = q + strspn(q, " \t");
+		p[strcspn(p, "\n")] = 0;
+		if (*p != 0 && data_series(data, p, &nr, 1)) {
+			r = 1;
+			break;
+		}
+		if (data_put_value(data, since, ts, nr, val, flags)) {
+			r = 1;
+			break;
+		}
+		last = seq;
+		if (lineno % 1024 == 0 &&
+		    (data_batch_commit(data) || data_batch_begin(data)))
+			r = 1;
+	}
+	if (ferror(fp)) {
+		fprintf(stderr, "import: %s: %s\n", fn, strerror(errno));
+		r = 1;
+	}
+	if (fp != stdin)
+		fclose(fp);
+	if (data_batch_commit(data))
+		r = 1;
+	if (last)
+		printf("%llu\n", last);
+	return (r);
+}
+
+/*
+ * Write the configuration of the image of a query of -g or -K, for
+ * its time frame, with a graph of number nr or the series name.
+ */
+static int
+write_getconf(const char *fn, const char *png, int nr, const char *name,
+    const char *timeframe)
+{
+	FILE *fp;
+
+	if ((fp = fopen(fn, "w")) == NULL) {
+		fprintf(stderr, "main: fopen fail\n");
+		return (1);
+	}
+	fprintf(fp, "image \"%s\" {\n", png);
+	fprintf(fp, "	%s\n", timeframe);
+	fprintf(fp, "	left\n");
+	if (nr > 0)
+		fprintf(fp, "		graph %d \"x\" \"y\" "
+		    "color 0 0 0\n}\n", nr);
+	else
+		fprintf(fp, "		graph \"%s\" \"x\" "
+		    "\"y\" color 0 0 0\n}\n", name);
+	fclose(fp);
+	return (0);
+}
+
 static void
 usage(void)
 {
 	extern char *__progname;
 
-	fprintf(stderr, "usage: %s [-v] [-c config ] [ -C configdir ] "
-	    "[-d data] [ -g number:timeframe ] [-p] [-q] [-t days[:days]] "
-	    "[-f file]\n", __progname);
+	fprintf(stderr, "usage: %s [-v] [-b file] [-c config ] "
+	    "[ -C configdir ] [-d data] [ -g [summary:]number:timeframe | "
+	    "snapshot:timeframe ] [-e seq] [-i] [-I file] [-k cache] "
+	    "[ -K max|avg:k:timeframe ] [-p] [-q] [-R] [-S] [-t days[:days]] "
+	    "[-f file] [-F]\n", __progname);
 	pool_free(pool);
 	exit(1);
 }
@@ -136,19 +725,34 @@ main(int argc, char *argv[])
 	const char *configdir = NULL;
 	const char *datafn = "/var/db/graffer.db";
 	const char *fixfn = NULL;
+	const char *backupfn = NULL;
+	const char *importfn = NULL;
+	const char *cachefn = NULL;
 	const char *getconf = "/tmp/.graffer.conf.temp";
 	const char *getpng = "/tmp/.graffer.png.temp";
-	FILE *fpget;
-	int ch, get = 0, query = 0, draw = 0, trunc = 0, i, colnum;
+	int ch, get = 0, query = 0, push = 0, draw = 0, trunc = 0, compact = 0;
+	int summary = 0, stats = 0, rebuild = 0, export = 0, getsnap = 0;
+	unsigned long long seq = 0;
+	unsigned long topk = 0;
+	int toptype = 0;
+	int i;
+	int colnum;
+	unsigned units;
 	int days[2] = { 31, 365 };
 	struct matrix *matrices = NULL, *m;
+	struct data *data;
+	struct data_conf conf;
 	struct graph *g;
 	DIR *dirp;
 	struct dirent *dp;
 
 	pool = pool_create(1024);
-	while ((ch = getopt(argc, argv, "c:C:d:f:g:pqt:v")) != -1) {
+	while ((ch = getopt(argc, argv,
+	    "b:c:C:d:e:f:Fg:iI:k:K:pqRSt:v")) != -1) {
 		switch (ch) {
+		case 'b':
+			backupfn = optarg;
+			break;
 		case 'c':
 			configfn = optarg;
 			break;
@@ -156,11 +760,35 @@ main(int argc, char *argv[])
 			configdir = optarg;
 			break;
 		case 'd':
-			datafn = optarg;
+			if (strchr(optarg, '=') == NULL)
+				datafn = optarg;
+			else if (add_host(optarg))
+				goto fail;
 			break;
+		case 'e': {
+			char *q;
+
+			seq = strtoull(optarg, &q, 10);
+			if (q == optarg || *q != 0)
+				usage();
+			export = 1;
+			break;
+		}
 		case 'f':
 			fixfn = optarg;
 			break;
+		case 'F':
+			compact++;
+			break;
+		case 'i':
+			push = 1;
+			break;
+		case 'I':
+			importfn = optarg;
+			break;
+		case 'k':
+			cachefn = optarg;
+			break;
 		case 'g': {
 			char *o, *p;
 			o = pool_strdup(pool, optarg);
@@ -169,7 +797,18 @@ main(int argc, char *argv[])
 				    strerror(errno));
 				goto fail;
 			}
-			p = strchr(o, ':');
+			if (strncmp(o, "summary:", 8) == 0) {
+				summary = 1;
+				o += 8;
+			} else if (strncmp(o, "snapshot:", 9) == 0) {
+				/* all units, the graph only holds the range */
+				if (write_getconf(getconf, getpng, 1, NULL,
+				    o + 9))
+					goto fail;
+				getsnap = get = 1;
+				break;
+			}
+			p = strrchr(o, ':');	/* the time frame has none */
 			if (p != NULL) {
 				*p = 0;
 				p += 1; // after ':'
@@ -178,21 +817,34 @@ main(int argc, char *argv[])
 				usage();
 			}
 			colnum = atoi(o);
-			if (colnum <= 0) {
+			if (colnum <= 0 && (isdigit((unsigned char)*o) ||
+			    !*o || strchr(o, '"') != NULL)) {
 				fprintf(stderr, "wrong get number: %d\n",
 				    colnum);
 				usage();
 			}
-			if ((fpget = fopen(getconf, "w")) == NULL) {
-				fprintf(stderr, "main: fopen fail\n");
+			if (write_getconf(getconf, getpng, colnum, o, p))
+				goto fail;
+			get = 1;
+			break;
+		}
+		case 'K': {
+			char *o, *p;
+
+			/* type:k:timeframe, of all units */
+			if (!strncmp(optarg, "max:", 4))
+				toptype = DATA_TYPE_MAX;
+			else if (!strncmp(optarg, "avg:", 4))
+				toptype = DATA_TYPE_AVG;
+			else
+				usage();
+			topk = strtoul(optarg + 4, &o, 10);
+			if (o == optarg + 4 || *o != ':' || topk == 0 ||
+			    topk > 100000)
+				usage();
+			p = o + 1;
+			if (write_getconf(getconf, getpng, 1, NULL, p))
 				goto fail;
-			}
-			fprintf(fpget, "image \"%s\" {\n", getpng);
-			fprintf(fpget, "	%s\n", p);
-			fprintf(fpget, "	left\n");
-			fprintf(fpget, "		graph %d \"x\" \"y\" "
-			    "color 0 0 0\n}\n", colnum);
-			fclose(fpget);
 			get = 1;
 			break;
 		}
@@ -202,6 +854,12 @@ main(int argc, char *argv[])
 		case 'q':
 			query = 1;
 			break;
+		case 'R':
+			rebuild = 1;
+			break;
+		case 'S':
+			stats = 1;
+			break;
 		case 't': {
 			char *o, *p;
 
@@ -231,7 +889,9 @@ main(int argc, char *argv[])
 	}
 	if (argc != optind)
 		usage();
-	if (!get && !query && !draw && !trunc && !fixfn)
+	if (!get && !query && !push && !draw && !trunc && !fixfn &&
+	    !compact && !stats && !backupfn && !rebuild && !export &&
+	    !importfn)
 		usage();
 
 	if (configdir != NULL) {
@@ -261,21 +921,99 @@ main(int argc, char *argv[])
 			goto fail;
 	}
 
-	if (data_open(datafn))
+	units = maxcol;
+	for (m = matrices; m != NULL; m = m->next)
+		for (i = 0; i < 2; ++i)
+			for (g = m->graphs[i]; g != NULL; g = g->next)
+				units++;
+	memset(&conf, 0, sizeof(conf));
+	conf.units = units;
+	conf.psize = pagesize;
+	conf.cachesize = cachesize;
+	conf.shards = shards;
+	conf.range = shardrange;
+	conf.gap = gap;
+	conf.changes = changes;
+	conf.snapshot = snapshot;
+	if ((data = data_open(datafn, 0, &conf)) == NULL)
 		goto fail;
+	data_sync_policy(data, syncpolicy);
+	for (i = 0; i < nhosts; ++i)
+		if ((hosts[i].data = data_open(hosts[i].fn, 1, &conf)) ==
+		    NULL)
+			goto dbfail;
+	if (resolve_names(data, draw || get ? matrices : NULL,
+	    draw ? NULL : getpng))
+		goto dbfail;
+	if (draw && cachefn != NULL && data_cache_open(data, cachefn))
+		goto dbfail;
 
 	if (get) {
+		struct data *gdata = data;
+
 		if (debug)
 			printf("get values\n");
 		for (m = matrices; m != NULL; m = m->next)
 			if (strcmp(m->filename, getpng) == 0)
 				break;
 		g = m->graphs[0]; // single graph, left (0)
+		if (g->host != NULL && !strcmp(g->host, "*")) {
+			fprintf(stderr, "main: -g takes a single host\n");
+			goto dbfail;
+		}
+		if (g->host != NULL)
+			gdata = find_host(g->host)->data;
 		if (debug)
 			printf("fetching values for unit %u from database\n",
 			    g->desc_nr);
-		if (data_get_values(g->desc_nr, m->beg, m->end, g->type,
-		    m->w0, g->data, 1)) {
+		if (topk) {
+			struct data_point *p;
+			unsigned n, j;
+
+			if (data_get_top(gdata, toptype, topk, m->beg, m->end,
+			    &p, &n)) {
+				fprintf(stderr, "main: data_get_top() "
+				    "failed\n");
+				goto dbfail;
+			}
+			for (j = 0; j < n; ++j)
+				if (p[j].name != NULL)
+					printf("%s %.2f\n", p[j].name,
+					    p[j].val);
+				else
+					printf("%u %.2f\n", p[j].unit,
+					    p[j].val);
+			free(p);
+		} else if (getsnap) {
+			struct data_point *p;
+			unsigned n, j;
+
+			if (data_get_snapshot(gdata, m->beg, m->end, &p, &n)) {
+				fprintf(stderr, "main: data_get_snapshot() "
+				    "failed\n");
+				goto dbfail;
+			}
+			for (j = 0; j < n; ++j)
+				if (p[j].name != NULL)
+					printf("%s %.17g %u\n", p[j].name,
+					    p[j].val, p[j].ts);
+				else
+					printf("%u %.17g %u\n", p[j].unit,
+					    p[j].val, p[j].ts);
+			free(p);
+		} else if (summary) {
+			struct data_summary s;
+
+			if (data_get_summary(gdata, g->desc_nr, m->beg,
+			    m->end, &s)) {
+				fprintf(stderr, "main: data_get_summary() "
+				    "failed\n");
+				goto dbfail;
+			}
+			printf("count: %.0f, min: %.2f, avg: %.2f, max: %.2f\n",
+			    s.count, s.min, s.avg, s.max);
+		} else if (data_get_values(gdata, g->desc_nr, m->beg,
+		    m->end, g->type, m->w0, g->data, 1)) {
 			fprintf(stderr, "main: data_get_values() failed\n");
 			goto dbfail;
 		}
@@ -284,7 +1022,7 @@ main(int argc, char *argv[])
 	if (trunc) {
 		if (debug)
 			printf("truncating database\n");
-		if (data_truncate(days[0], days[1])) {
+		if (data_truncate(data, days[0], days[1])) {
 			fprintf(stderr, "main: data_truncate() failed\n");
 			goto dbfail;
 		}
@@ -296,42 +1034,71 @@ main(int argc, char *argv[])
 			printf("querying values\n");
 
 		for (i = 0; i < maxcol; ++i) {
+			if (cols[i].hi)
+				continue;
 			if (debug)
 				printf("set_col(%d, %s, %lf)\n", cols[i].nr,
 				    cols[i].arg,  value_query(cols[i].arg));
 			set_col(cols[i].nr, value_query(cols[i].arg));
 		}
+		aggregate();
 
 		if (debug)
 			printf("storing values in database\n");
+		if (data_batch_begin(data))
+			goto dbfail;
 		for (i = 0; i < maxcol; ++i)
-			if (data_put_value(since, time(NULL), cols[i].nr,
-			    cols[i].val, cols[i].tdiff, cols[i].vdiff)) {
+			if (data_put_value(data, since, time(NULL),
+			    cols[i].nr, cols[i].val, cols[i].flags)) {
 				fprintf(stderr, "main: data_put_value() "
 				    "failed\n");
 				goto dbfail;
 			}
+		if (data_batch_commit(data)) {
+			fprintf(stderr, "main: data_batch_commit() failed\n");
+			goto dbfail;
+		}
 
 	}
 
+	if (push) {
+		if (debug)
+			printf("storing values from stdin\n");
+		if (journal && data_journal_open(data, journal)) {
+			fprintf(stderr, "main: data_journal_open() failed\n");
+			goto dbfail;
+		}
+		if (ingest(data)) {
+			fprintf(stderr, "main: ingest() failed\n");
+			goto dbfail;
+		}
+		if (journal && data_journal_close(data)) {
+			fprintf(stderr, "main: data_journal_close() failed\n");
+			goto dbfail;
+		}
+	}
+
+	if (importfn) {
+		if (debug)
+			printf("importing changes from %s\n", importfn);
+		if (import(data, importfn)) {
+			fprintf(stderr, "main: import() failed\n");
+			goto dbfail;
+		}
+	}
+
+	if (export) {
+		if (data_export(data, seq, stdout)) {
+			fprintf(stderr, "main: data_export() failed\n");
+			goto dbfail;
+		}
+	}
+
 	if (draw) {
 		if (debug)
 			printf("generating images\n");
-		for (m = matrices; m != NULL; m = m->next)
-			for (i = 0; i < 2; ++i)
-				for (g = m->graphs[i]; g != NULL; g = g->next) {
-					if (debug)
-						printf("fetching values for "
-						    "unit %u from database\n",
-						    g->desc_nr);
-					if (data_get_values(g->desc_nr, m->beg,
-					    m->end, g->type, m->w0, g->data, 0)) {
-						fprintf(stderr, "main: "
-						    "data_get_values() "
-						    "failed\n");
-						goto dbfail;
-					}
-				}
+		if (fetch_values(data, matrices))
+			goto dbfail;
 		if (debug)
 			printf("drawing and writing images\n");
 		if (graph_generate_images(matrices)) {
@@ -342,21 +1109,59 @@ main(int argc, char *argv[])
 
 	}
 
+	if (rebuild) {
+		if (debug)
+			printf("rebuilding rollups\n");
+		if (data_rebuild(data, col_flags)) {
+			fprintf(stderr, "main: data_rebuild() failed\n");
+			goto dbfail;
+		}
+	}
+
+	if (stats) {
+		if (data_stats(data)) {
+			fprintf(stderr, "main: data_stats() failed\n");
+			goto dbfail;
+		}
+	}
+
 	if (fixfn) {
 		if (debug)
 			printf("fixing database %s to %s\n", datafn, fixfn);
-		if (data_copy(fixfn)) {
+		if (data_copy(data, fixfn)) {
 			fprintf(stderr, "main: data_copy() failed\n");
 			goto dbfail;
 		}
 	}
 
-	data_close();
+	close_hosts();
+	data_close(data);
+
+	if (backupfn) {
+		if (debug)
+			printf("backing up database %s to %s\n", datafn,
+			    backupfn);
+		if (data_backup(datafn, backupfn, &conf)) {
+			fprintf(stderr, "main: data_backup() failed\n");
+			goto fail;
+		}
+	}
+
+	if (compact) {
+		if (debug)
+			printf("compacting database %s\n", datafn);
+		if (data_compact(datafn, compact > 1, &conf)) {
+			fprintf(stderr, "main: data_compact() failed\n");
+			goto fail;
+		}
+	}
+
 	pool_free(pool);
 	return (0);
 
 dbfail:
-	data_close();
+	close_hosts();
+	data_close(data);
 
 fail:
 	pool_free(pool);
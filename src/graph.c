@@ -37,6 +37,7 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -91,8 +92,8 @@ graph_add_matrix(struct pool *pool, struct matrix **matrices,
 
 int
 graph_add_graph(struct pool *pool, struct graph **graphs, unsigned width,
-    unsigned desc_nr, const char *label, const char *unit, unsigned color,
-    int filled, int bytes, int type)
+    unsigned desc_nr, const char *name, const char *label, const char *unit,
+    unsigned color, int filled, int bytes, int type, struct expr *expr)
 {
 	unsigned i;
 	struct graph *g;
@@ -105,6 +106,9 @@ graph_add_graph(struct pool *pool, struct graph **graphs, unsigned width,
 	if (g->unit == NULL)
 		err(1, "pool_strdup");
 	g->desc_nr = desc_nr;
+	if (name != NULL && (g->name = pool_strdup(pool, name)) == NULL)
+		err(1, "pool_strdup");
+	g->expr = expr;
 	g->label = pool_strdup(pool, label);
 	if (g->label == NULL)
 		err(1, "pool_strdup");
@@ -118,6 +122,7 @@ graph_add_graph(struct pool *pool, struct graph **graphs, unsigned width,
 	for (i = 0; i < width; ++i)
 		g->data[i] = 0.0;
 	g->data_max = 0.0;
+	g->data_min = 0.0;
 	if (*graphs == NULL)
 		g->next = NULL;
 	else
@@ -146,18 +151,24 @@ graph_generate_images(struct matrix *matrices)
 
 		find_max(matrix);
 		for (i = 0; i < 2; ++i) {
-			double m = 0.0;
+			double m = 0.0, lo = 0.0;
 
 			for (graph = matrix->graphs[i]; graph;
-			    graph = graph->next)
+			    graph = graph->next) {
 				if (graph->data_max > m)
 					m = graph->data_max;
+				if (graph->data_min < lo)
+					lo = graph->data_min;
+			}
 			for (graph = matrix->graphs[i]; graph;
-			    graph = graph->next)
+			    graph = graph->next) {
 				graph->data_max = m;
+				graph->data_min = lo;
+			}
 			if (debug)
 				printf("graph_generate_images: maximum %s "
-				    "%.2f\n", i ? "right" : "left", m);
+				    "%.2f, minimum %.2f\n", i ? "right" :
+				    "left", m, lo);
 		}
 		normalize(matrix);
 
@@ -210,6 +221,7 @@ graph_generate_images(struct matrix *matrices)
 	return (0);
 }
 
+/* the range of values of each graph, from 0 or below */
 void
 find_max(struct matrix *m)
 {
@@ -219,23 +231,31 @@ find_max(struct matrix *m)
 	for (i = 0; i < 2; ++i)
 		for (g = m->graphs[i]; g != NULL; g = g->next) {
 			g->data_max = 0.0;
+			g->data_min = 0.0;
 			for (j = 0; j < m->w0; ++j)
 				if (g->data[j] > g->data_max)
 					g->data_max = g->data[j];
+				else if (g->data[j] < g->data_min)
+					g->data_min = g->data[j];
 		}
 }
 
+/* scale the values from the range data_min to data_max to 0 to 1 */
 void
 normalize(struct matrix *m)
 {
 	unsigned i, j;
 	struct graph *g;
+	double range;
 
 	for (i = 0; i < 2; ++i)
-		for (g = m->graphs[i]; g != NULL; g = g->next)
-			if (g->data_max != 0.0)
+		for (g = m->graphs[i]; g != NULL; g = g->next) {
+			range = g->data_max - g->data_min;
+			if (range != 0.0)
 				for (j = 0; j < m->w0; ++j)
-					g->data[j] /= g->data_max;
+					g->data[j] = (g->data[j] -
+					    g->data_min) / range;
+		}
 }
 
 void
@@ -243,23 +263,35 @@ draw(gdImagePtr im, struct matrix *m, struct graph *g, int color,
     unsigned filled)
 {
 	unsigned x = m->x0, y = m->y0, w = m->w0, h = m->h0;
-	unsigned dx, dy0 = 0;
+	unsigned dx, dy0 = 0, dz = 0;
 	int border = gdImageColorAllocate(im, 0, 64, 96);
+	int gap = 1;
+
+	/* filled from 0, above the bottom if there are values below */
+	if (g->data_max > g->data_min)
+		dz = -g->data_min / (g->data_max - g->data_min) * h;
 
 	for (dx = 0; dx < w; ++dx) {
-		unsigned dy = g->data[dx] * h;
+		unsigned dy;
 
+		/* pixels without values are left blank */
+		if (isnan(g->data[dx])) {
+			gap = 1;
+			continue;
+		}
+		dy = g->data[dx] * h;
 		if (filled) {
-			gdImageLine(im, x+dx+1, y+h-1, x+dx+1, y+h-1-dy,
+			gdImageLine(im, x+dx+1, y+h-1-dz, x+dx+1, y+h-1-dy,
 			    color);
-			if (dx > 0)
+			if (!gap)
 				gdImageLine(im, x+dx, y+h-1-dy0, x+dx+1,
 				    y+h-1-dy, border);
 		}
-		else if (dx > 0)
+		else if (!gap)
 			gdImageLine(im, x+dx, y+h-1-dy0, x+dx+1, y+h-1-dy,
 			    color);
 		dy0 = dy;
+		gap = 0;
 	}
 }
 
@@ -287,6 +319,16 @@ scale_unit(double *m, char *k, int bytes)
 	}
 }
 
+/* the value of the axis at step i of ii from the top */
+static double
+axis_value(double min, double max, unsigned i, unsigned ii)
+{
+	double v = min + ((max - min) * (ii - i)) / ii;
+
+	/* printed with one decimal, rather than as -0.0 */
+	return (v < 0.0 && v > -0.05 ? 0.0 : v);
+}
+
 void
 draw_grid(gdImagePtr im, struct matrix *matrix)
 {
@@ -294,7 +336,7 @@ draw_grid(gdImagePtr im, struct matrix *matrix)
 	unsigned x0 = matrix->x0, y0 = matrix->y0,
 	    w0 = matrix->w0, h0 = matrix->h0;
 	unsigned len = matrix->end - matrix->beg;
-	double max[2] = { 0.0, 0.0 };
+	double max[2] = { 0.0, 0.0 }, min[2] = { 0.0, 0.0 };
 	const char *unit[2] = { NULL, NULL };
 	unsigned i, ii;
 	char k[2];
@@ -307,15 +349,21 @@ draw_grid(gdImagePtr im, struct matrix *matrix)
 		frontcolor = gdImageColorAllocate(im,   0,   0,   0);
 	else
 		frontcolor = gdImageColorAllocate(im, 255, 255, 255);
-	if (matrix->graphs[0] != NULL) {
-		max[0] = matrix->graphs[0]->data_max;
-		scale_unit(&max[0], &k[0], matrix->graphs[0]->bytes);
-		unit[0] = matrix->graphs[0]->unit;
-	}
-	if (matrix->graphs[1] != NULL) {
-		max[1] = matrix->graphs[1]->data_max;
-		scale_unit(&max[1], &k[1], matrix->graphs[1]->bytes);
-		unit[1] = matrix->graphs[1]->unit;
+	for (i = 0; i < 2; ++i) {
+		double m, m0;
+
+		if (matrix->graphs[i] == NULL)
+			continue;
+		max[i] = matrix->graphs[i]->data_max;
+		min[i] = matrix->graphs[i]->data_min;
+		/* both ends in the unit of the larger one */
+		m = m0 = max[i] > -min[i] ? max[i] : -min[i];
+		scale_unit(&m, &k[i], matrix->graphs[i]->bytes);
+		if (m0 != 0.0) {
+			max[i] *= m / m0;
+			min[i] *= m / m0;
+		}
+		unit[i] = matrix->graphs[i]->unit;
 	}
 
 	/* bounding box */
@@ -337,13 +385,13 @@ draw_grid(gdImagePtr im, struct matrix *matrix)
 			gdImageLine(im, x0+1, y1, x0+w0-1, y1, grey);
 		if (matrix->graphs[0] != NULL) {
 			snprintf(t, sizeof(t), "%5.1f %c",
-			    (max[0]*(ii-i))/ii, k[0]);
+			    axis_value(min[0], max[0], i, ii), k[0]);
 			gdImageString(im, gdFontSmall, fh+fw,
 			    y1-fh/2, t, frontcolor);
 		}
 		if (matrix->graphs[1] != NULL) {
 			snprintf(t, sizeof(t), "%5.1f %c",
-			    (max[1]*(ii-i))/ii, k[1]);
+			    axis_value(min[1], max[1], i, ii), k[1]);
 			gdImageString(im, gdFontSmall, x0+w0+1*fw,
 			    y1-fh/2, t, frontcolor);
 		}
@@ -34,6 +34,9 @@
 
 struct graph {
 	unsigned	 desc_nr;
+	char		*name;	/* series name, desc_nr looked up later */
+	struct expr	*expr;	/* derived from other series, or NULL */
+	char		*host;	/* of a database given with -d, or "*" */
 	char		*label;
 	char		*unit;
 	u_int32_t	 color;	/* 0x00RRGGBB */
@@ -44,6 +47,7 @@ struct graph {
 	u_int64_t	 v[2];
 	double		*data;
 	double		 data_max;
+	double		 data_min;	/* 0, or below if values are */
 	struct graph	*next;
 };
 
@@ -60,7 +64,8 @@ struct matrix {
 int	 graph_add_matrix(struct pool *, struct matrix **, const char *,
 	    unsigned, unsigned, unsigned, unsigned, unsigned);
 int	 graph_add_graph(struct pool *, struct graph **, unsigned, unsigned,
-	    const char *, const char *, u_int32_t, int, int, int);
+	    const char *, const char *, const char *, u_int32_t, int, int,
+	    int, struct expr *);
 int	 graph_generate_images(struct matrix *);
 
 #endif
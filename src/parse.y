@@ -45,9 +45,15 @@
 #include "pool.h"
 #include "data.h"
 #include "graph.h"
+#include "expr.h"
 
-extern int add_col(unsigned nr, const char *arg, int tdiff, int vdiff);
+extern int add_col(unsigned nr, const char *name, const char *arg,
+    int flags);
+extern int add_aggregate(unsigned nr, const char *name, int type,
+    unsigned lo, unsigned hi, int flags);
 extern struct pool *pool;
+extern unsigned cachesize, pagesize, shards, shardrange, gap;
+extern int syncpolicy, journal, changes, snapshot;
 
 static const char *infile = NULL;
 static struct matrix **matrices = NULL;
@@ -80,6 +86,11 @@ typedef struct {
 			struct node_graph	*graph;
 		}			 side;
 		struct node_graph	*graph;
+		struct {
+			unsigned	 nr;
+			char		*name;
+			struct expr	*expr;
+		}			 series;
 		struct {
 			int		 theme;
 			char		*arg;
@@ -95,7 +106,9 @@ typedef struct {
 
 %token	ERROR IMAGE TIME MINUTES HOURS DAYS WEEKS MONTHS YEARS TO NOW
 %token	WIDTH HEIGHT LEFT RIGHT GRAPH COLOR FILLED THEME WHITE BLACK
-%token	COLLECT TDIFF VDIFF BPS AVG MIN MAX
+%token	COLLECT TDIFF VDIFF BPS AVG MIN MAX SET CACHESIZE PAGESIZE
+%token	SYNC TICK NEVER JOURNAL SHARDS RANGE SKETCH PERCENTILE GAP CHANGES
+%token	SNAPSHOT EXPR AGGREGATE SUM
 %token	<v.string>	STRING
 %token	<v.number>	NUMBER
 %type	<v.time>	timerange
@@ -103,30 +116,154 @@ typedef struct {
 %type	<v.number>	theme
 %type	<v.side>	left right
 %type	<v.graph>	graph_item graph_list
-%type	<v.number>	time filled tdiff vdiff bps avg
+%type	<v.number>	time filled tdiff vdiff sketch bps avg aggfunc
+%type	<v.series>	series graph_series
 %%
 
 configuration	: /* empty */
 		| configuration collect
+		| configuration aggregate
 		| configuration image
+		| configuration set
 		| configuration error		{ errors++; }
 		;
 
-collect		: COLLECT NUMBER '=' STRING tdiff vdiff
+collect		: COLLECT series '=' STRING tdiff vdiff sketch
 		{
-			if (add_col($2, $4, $5, $6)) {
+			if (add_col($2.nr, $2.name, $4, $5 | $6 | $7)) {
 				yyerror("add_col() failed");
 				YYERROR;
 			}
 		}
 		;
 
+aggregate	: AGGREGATE series '=' aggfunc '(' NUMBER '.' '.' NUMBER ')'
+		    tdiff vdiff sketch
+		{
+			if ($6 <= 0 || $9 < $6) {
+				yyerror("invalid range %d..%d", $6, $9);
+				YYERROR;
+			}
+			if (add_aggregate($2.nr, $2.name, $4, $6, $9,
+			    $11 | $12 | $13)) {
+				yyerror("add_aggregate() failed");
+				YYERROR;
+			}
+		}
+		;
+
+aggfunc		: SUM				{ $$ = 0; }
+		| AVG				{ $$ = DATA_TYPE_AVG; }
+		| MIN				{ $$ = DATA_TYPE_MIN; }
+		| MAX				{ $$ = DATA_TYPE_MAX; }
+		;
+
+series		: NUMBER
+		{
+			if ($1 <= 0 || $1 > DATA_UNIT_MAX) {
+				yyerror("invalid collect number %d", $1);
+				YYERROR;
+			}
+			$$.nr = $1;
+			$$.name = NULL;
+		}
+		| STRING
+		{
+			if (!*$1 || strlen($1) > DATA_NAME_MAX) {
+				yyerror("invalid series name \"%s\"", $1);
+				YYERROR;
+			}
+			$$.nr = 0;
+			$$.name = $1;
+		}
+		;
+
+set		: SET CACHESIZE NUMBER
+		{
+			cachesize = $3;
+		}
+		| SET PAGESIZE NUMBER
+		{
+			if ($3 < 512 || $3 > 65536 || ($3 & ($3 - 1))) {
+				yyerror("invalid pagesize %d", $3);
+				YYERROR;
+			}
+			pagesize = $3;
+		}
+		| SET SYNC TICK
+		{
+			syncpolicy = DATA_SYNC_TICK;
+		}
+		| SET SYNC NEVER
+		{
+			syncpolicy = DATA_SYNC_NEVER;
+		}
+		| SET SYNC NUMBER
+		{
+			if ($3 <= 0) {
+				yyerror("invalid sync interval %d", $3);
+				YYERROR;
+			}
+			syncpolicy = $3;
+		}
+		| SET JOURNAL NUMBER
+		{
+			if ($3 <= 0) {
+				yyerror("invalid journal interval %d", $3);
+				YYERROR;
+			}
+			journal = $3;
+		}
+		| SET CHANGES
+		{
+			changes = 1;
+		}
+		| SET SNAPSHOT
+		{
+			snapshot = 1;
+		}
+		| SET GAP NUMBER
+		{
+			if ($3 <= 0) {
+				yyerror("invalid gap %d", $3);
+				YYERROR;
+			}
+			gap = $3;
+		}
+		| SET SHARDS NUMBER
+		{
+			if ($3 <= 0 || $3 > 1024) {
+				yyerror("invalid number of shards %d", $3);
+				YYERROR;
+			}
+			shards = $3;
+			shardrange = 0;
+		}
+		| SET SHARDS NUMBER RANGE NUMBER
+		{
+			if ($3 <= 0 || $3 > 1024) {
+				yyerror("invalid number of shards %d", $3);
+				YYERROR;
+			}
+			if ($5 <= 0) {
+				yyerror("invalid shard range %d", $5);
+				YYERROR;
+			}
+			shards = $3;
+			shardrange = $5;
+		}
+		;
+
 tdiff		: /* empty */		{ $$ = 0; }
-		| TDIFF			{ $$ = 1; }
+		| TDIFF			{ $$ = DATA_TDIFF; }
 		;
 
 vdiff		: /* empty */		{ $$ = 0; }
-		| VDIFF			{ $$ = 1; }
+		| VDIFF			{ $$ = DATA_VDIFF; }
+		;
+
+sketch		: /* empty */		{ $$ = 0; }
+		| SKETCH		{ $$ = DATA_SKETCH; }
 		;
 
 image		: IMAGE STRING '{' timerange theme size left right '}'
@@ -143,18 +280,20 @@ image		: IMAGE STRING '{' timerange theme size left right '}'
 			while (g != NULL) {
 				graph_add_graph(pool, &(*matrices)->graphs[0],
 				    (*matrices)->w0, g->graph.desc_nr,
-				    g->graph.label, g->graph.unit,
-				    g->graph.color, g->graph.filled,
-				    g->graph.bytes, g->graph.type);
+				    g->graph.name, g->graph.label,
+				    g->graph.unit, g->graph.color,
+				    g->graph.filled, g->graph.bytes,
+				    g->graph.type, g->graph.expr);
 				g = g->next;
 			}
 			g = $8.graph;
 			while (g != NULL) {
 				graph_add_graph(pool, &(*matrices)->graphs[1],
 				    (*matrices)->w0, g->graph.desc_nr,
-				    g->graph.label, g->graph.unit,
-				    g->graph.color, g->graph.filled,
-				    g->graph.bytes, g->graph.type);
+				    g->graph.name, g->graph.label,
+				    g->graph.unit, g->graph.color,
+				    g->graph.filled, g->graph.bytes,
+				    g->graph.type, g->graph.expr);
 				g = g->next;
 			}
 		}
@@ -227,13 +366,15 @@ graph_list	: graph_item			{ $$ = $1; }
 		| graph_list ',' graph_item	{ $3->next = $1; $$ = $3; }
 		;
 
-graph_item	: GRAPH NUMBER bps avg STRING STRING COLOR NUMBER NUMBER NUMBER filled
+graph_item	: GRAPH graph_series bps avg STRING STRING COLOR NUMBER NUMBER NUMBER filled
 		{
 			$$ = pool_alloc(pool, sizeof(struct node_graph));
 			if ($$ == NULL)
 				err(1, "graph_item: pool_alloc");
 			memset($$, 0, sizeof(struct node_graph));
-			$$->graph.desc_nr = $2;
+			$$->graph.desc_nr = $2.nr;
+			$$->graph.name = $2.name;
+			$$->graph.expr = $2.expr;
 			$$->graph.bytes = $3;
 			$$->graph.type = $4;
 			$$->graph.label = pool_strdup(pool, $5);
@@ -248,10 +389,28 @@ graph_item	: GRAPH NUMBER bps avg STRING STRING COLOR NUMBER NUMBER NUMBER fille
 		}
 		;
 
+graph_series	: series			{ $$ = $1; $$.expr = NULL; }
+		| EXPR STRING			{
+			if (($$.expr = expr_parse(pool, $2)) == NULL) {
+				yyerror("invalid expression \"%s\"", $2);
+				YYERROR;
+			}
+			$$.nr = 0;
+			$$.name = NULL;
+		}
+		;
+
 avg		: /* empty */			{ $$ = DATA_TYPE_AVG; }
 		| AVG				{ $$ = DATA_TYPE_AVG; }
 		| MIN				{ $$ = DATA_TYPE_MIN; }
 		| MAX				{ $$ = DATA_TYPE_MAX; }
+		| PERCENTILE NUMBER		{
+			if ($2 < 1 || $2 > 99) {
+				yyerror("invalid percentile %d", $2);
+				YYERROR;
+			}
+			$$ = DATA_TYPE_PERCENTILE($2);
+		}
 		;
 
 filled		: /* empty */			{ $$ = 0; }
@@ -294,27 +453,44 @@ lookup(char *s)
 {
 	/* this has to be sorted always */
 	static const struct keywords keywords[] = {
+		{ "aggregate",	AGGREGATE },
 		{ "avg",	AVG },
 		{ "black",	BLACK },
 		{ "bps",	BPS },
+		{ "cachesize",	CACHESIZE },
+		{ "changes",	CHANGES },
 		{ "collect",	COLLECT },
 		{ "color",	COLOR },
 		{ "days",	DAYS },
+		{ "expr",	EXPR },
 		{ "filled",	FILLED },
 		{ "from",	TIME },
+		{ "gap",	GAP },
 		{ "graph",	GRAPH },
 		{ "height",	HEIGHT },
 		{ "hours",	HOURS },
 		{ "image",	IMAGE },
+		{ "journal",	JOURNAL },
 		{ "left",	LEFT },
 		{ "max",	MAX },
 		{ "min",	MIN },
 		{ "minutes",	MINUTES },
 		{ "months",	MONTHS },
+		{ "never",	NEVER },
 		{ "now",	NOW },
+		{ "pagesize",	PAGESIZE },
+		{ "percentile",	PERCENTILE },
+		{ "range",	RANGE },
 		{ "right",	RIGHT },
+		{ "set",	SET },
+		{ "shards",	SHARDS },
+		{ "sketch",	SKETCH },
+		{ "snapshot",	SNAPSHOT },
+		{ "sum",	SUM },
+		{ "sync",	SYNC },
 		{ "tdiff",	TDIFF },
 		{ "theme",	THEME },
+		{ "tick",	TICK },
 		{ "to",		TO },
 		{ "vdiff",	VDIFF },
 		{ "weeks",	WEEKS },
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2025, Nikola Kolev <koue@chaosophia.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sketch.h"
+
+/*
+ * Buckets grow by GAMMA, so any value is within 2% of the center of
+ * its bucket.  Keys order negative values, zero and positive values.
+ */
+#define	GAMMA		(1.02 / 0.98)
+#define	MIN_ABS		1e-9
+#define	MAX_INDEX	8191
+#define	KEY_ZERO	0x8000
+#define	KEY_POS		0xc000
+#define	KEY_NEG		0x4000
+
+static u_int16_t
+sketch_key(double v)
+{
+	int i;
+
+	if (fabs(v) < MIN_ABS)
+		return (KEY_ZERO);
+	i = ceil(log(fabs(v)) / log(GAMMA));
+	if (i > MAX_INDEX)
+		i = MAX_INDEX;
+	if (i < -MAX_INDEX)
+		i = -MAX_INDEX;
+	return (v > 0.0 ? KEY_POS + i : KEY_NEG - i);
+}
+
+static double
+sketch_value(u_int16_t key)
+{
+	int i;
+
+	if (key == KEY_ZERO)
+		return (0.0);
+	i = key > KEY_ZERO ? key - KEY_POS : KEY_NEG - key;
+	return ((key > KEY_ZERO ? 2.0 : -2.0) * pow(GAMMA, i) /
+	    (GAMMA + 1.0));
+}
+
+void
+sketch_init(struct sketch *s)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+void
+sketch_free(struct sketch *s)
+{
+	free(s->bin);
+	sketch_init(s);
+}
+
+void
+sketch_reset(struct sketch *s)
+{
+	s->n = 0;
+}
+
+static int
+sketch_add_key(struct sketch *s, u_int16_t key, u_int32_t count)
+{
+	struct sketch_bin *b;
+	unsigned lo = 0, hi = s->n, m;
+
+	while (lo < hi) {
+		m = (lo + hi) / 2;
+		if (s->bin[m].key < key)
+			lo = m + 1;
+		else
+			hi = m;
+	}
+	if (lo < s->n && s->bin[lo].key == key) {
+		s->bin[lo].count += count;
+		return (0);
+	}
+	if (s->n == s->max) {
+		m = s->max ? 2 * s->max : 16;
+		if ((b = reallocarray(s->bin, m, sizeof(*b))) == NULL) {
+			fprintf(stderr, "sketch_add: reallocarray: %s\n",
+			    strerror(errno));
+			return (1);
+		}
+		s->bin = b;
+		s->max = m;
+	}
+	memmove(&s->bin[lo + 1], &s->bin[lo], (s->n - lo) * sizeof(*s->bin));
+	s->bin[lo].key = key;
+	s->bin[lo].pad = 0;
+	s->bin[lo].count = count;
+	s->n++;
+	/* too many buckets, fold the lowest ones together */
+	if (s->n > SKETCH_MAX_BINS) {
+		s->bin[1].count += s->bin[0].count;
+		memmove(&s->bin[0], &s->bin[1], --s->n * sizeof(*s->bin));
+	}
+	return (0);
+}
+
+int
+sketch_add(struct sketch *s, double val, unsigned count)
+{
+	if (!count || isnan(val))
+		return (0);
+	return (sketch_add_key(s, sketch_key(val), count));
+}
+
+/* merge buckets as stored after a rollup record */
+int
+sketch_merge(struct sketch *s, const void *bins, size_t size)
+{
+	struct sketch_bin b;
+	const char *p = bins;
+
+	if (size % sizeof(b))
+		return (1);
+	for (; size; size -= sizeof(b), p += sizeof(b)) {
+		memcpy(&b, p, sizeof(b));
+		if (sketch_add_key(s, b.key, b.count))
+			return (1);
+	}
+	return (0);
+}
+
+double
+sketch_quantile(const struct sketch *s, double q)
+{
+	double total = 0.0, rank, seen = 0.0;
+	unsigned i;
+
+	if (!s->n)
+		return (0.0);
+	for (i = 0; i < s->n; ++i)
+		total += s->bin[i].count;
+	rank = q * (total - 1.0);
+	for (i = 0; i < s->n - 1; ++i) {
+		seen += s->bin[i].count;
+		if (seen > rank)
+			break;
+	}
+	return (sketch_value(s->bin[i].key));
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2025, Nikola Kolev <koue@chaosophia.net>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _SKETCH_H_
+#define _SKETCH_H_
+
+/*
+ * Mergeable quantile sketch with relative accuracy (DDSketch).  Values
+ * are counted in buckets growing by a constant factor; a bucket is the
+ * key followed by its count, stored sorted by key.
+ */
+struct sketch_bin {
+	u_int16_t	 key;
+	u_int16_t	 pad;
+	u_int32_t	 count;
+};
+
+#define SKETCH_MAX_BINS	256
+
+struct sketch {
+	struct sketch_bin *bin;
+	unsigned	 n, max;
+};
+
+void	 sketch_init(struct sketch *);
+void	 sketch_free(struct sketch *);
+void	 sketch_reset(struct sketch *);
+int	 sketch_add(struct sketch *, double val, unsigned count);
+int	 sketch_merge(struct sketch *, const void *bins, size_t size);
+double	 sketch_quantile(const struct sketch *, double q);
+
+#endif